@@ -1,12 +1,30 @@
 #include "client.hpp"
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/bind.hpp>
 
 
 TcpClient::TcpClient(boost::asio::io_service& ioService, const std::string& _userName,
-        const std::string& server, const std::string& port)
-    : userName(_userName), resolver(ioService), socket(ioService) {
+        const std::string& server, const std::string& port,
+        const SocketOptions& _options)
+    : userName(_userName), options(_options), chunkSizer(_options),
+    resolver(ioService), socket(ioService), localSocket(server == "unix"),
+    sendSize(0), recvOffset(0), recvRemain(0), recvSize(0),
+    buf(_options.maxChunkSize), downFd(-1), passedFd(-1) {
+        if (localSocket) {
+            // port is the socket path here
+            boost::asio::local::stream_protocol::endpoint endpoint(port);
+            socket.async_connect(boost::asio::generic::stream_protocol::endpoint(endpoint),
+                    boost::bind(&TcpClient::handleLocalConnect, this,
+                        boost::asio::placeholders::error));
+            return;
+        }
+
         boost::asio::ip::tcp::resolver::query query(server, port);
         resolver.async_resolve(query, boost::bind(&TcpClient::handleResolve, this,
                     boost::asio::placeholders::error, boost::asio::placeholders::iterator));
@@ -16,6 +34,8 @@ void TcpClient::handleResolve(const boost::system::error_code& error,
         boost::asio::ip::tcp::resolver::iterator myIterator) {
     if (!error) {
         boost::asio::ip::tcp::endpoint endpoint = *myIterator;
+        socket.open(endpoint.protocol());
+        applySocketBuffers(socket.native_handle(), options);
         socket.async_connect(endpoint,
                 boost::bind(&TcpClient::handleConnect, this,
                     boost::asio::placeholders::error, ++myIterator));
@@ -27,10 +47,13 @@ void TcpClient::handleResolve(const boost::system::error_code& error,
 void TcpClient::handleConnect(const boost::system::error_code& error,
         boost::asio::ip::tcp::resolver::iterator myIterator) {
     if (!error) {
+        applySocketOptions(socket.native_handle(), options);
         userNameRequest();
     } else if (myIterator != boost::asio::ip::tcp::resolver::iterator()) {
         socket.close();
         boost::asio::ip::tcp::endpoint endpoint = *myIterator;
+        socket.open(endpoint.protocol());
+        applySocketBuffers(socket.native_handle(), options);
         socket.async_connect(endpoint,
                 boost::bind(&TcpClient::handleConnect, this,
                     boost::asio::placeholders::error, ++myIterator));
@@ -39,6 +62,15 @@ void TcpClient::handleConnect(const boost::system::error_code& error,
     }
 }
 
+void TcpClient::handleLocalConnect(const boost::system::error_code& error) {
+    if (!error) {
+        applySocketOptions(socket.native_handle(), options);
+        userNameRequest();
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+    }
+}
+
 void TcpClient::fileSendRequest(const std::string& fileName) {
     upFile.open(fileName.c_str(), std::ios_base::binary | std::ios_base::ate);
     if (!upFile) {
@@ -46,11 +78,14 @@ void TcpClient::fileSendRequest(const std::string& fileName) {
         return;
     }
 
-    size_t fileSize = upFile.tellg();
+    sendSize = upFile.tellg();
     upFile.seekg(0);
+    // Only the holes are known up front, zero blocks are found while sending
+    sendCursor.reset(mapHoleExtents(fileName, sendSize));
+    sendEncoder.reset();
 
     std::ostream requestStream(&request);
-    requestStream << "u\n" << fileName << "\n" << fileSize << "\n\n";
+    requestStream << "u\n" << fileName << "\n" << sendSize << "\n\n";
 //    std::cout << "Request size: " << request.size()
 //        << "bytes" << std::endl;
 
@@ -58,18 +93,26 @@ void TcpClient::fileSendRequest(const std::string& fileName) {
 
     std::cout << "Uploading " << fileName << "... " << std::flush;
 
+    // Send the header together with the first data chunk
+    if (options.cork)
+        setCork(socket.native_handle(), true);
+
     async_write(socket, request,
             boost::bind(&TcpClient::handleFileSend, this,
                 boost::asio::placeholders::error));
 }
 
 void TcpClient::fileRecvRequest(const std::string& fileName) {
+    if (localSocket)
+        return fileRecvLocalRequest(fileName);
+
     std::ostream requestStream(&request);
     requestStream << "d\n" << fileName << "\n\n";
 //    std::cout << "Request size: " << request.size()
 //        << "bytes" << std::endl;
 
-    downFile.open(fileName.c_str(), std::ios_base::binary);
+    downFilePath = fileName;
+    downFile.open(downFilePath.c_str(), std::ios_base::binary);
 
     if (!downFile) {
         std::cerr << "Failed to open " << fileName << std::endl;
@@ -83,6 +126,38 @@ void TcpClient::fileRecvRequest(const std::string& fileName) {
                 boost::asio::placeholders::error));
 }
 
+void TcpClient::fileRecvLocalRequest(const std::string& fileName) {
+    downFilePath = fileName;
+
+    // An existing file is only replaced once the download has succeeded
+    std::string tempTemplate = downFilePath + ".XXXXXX";
+    std::vector<char> tempPath(tempTemplate.begin(), tempTemplate.end());
+    tempPath.push_back('\0');
+
+    downFd = mkostemp(tempPath.data(), O_CLOEXEC);
+
+    if (downFd < 0) {
+        std::cerr << "Failed to open " << fileName << std::endl;
+        return requestToServer();
+    }
+
+    downTempPath = tempPath.data();
+    fchmod(downFd, 0644);
+
+    // The server passes its descriptor instead of the file data
+    std::ostream requestStream(&request);
+    requestStream << "f\n" << fileName << "\n\n";
+
+    passedFd = -1;
+    fdAck.clear();
+
+    std::cout << "Downloading " << fileName << "... " << std::flush;
+
+    async_write(socket, request,
+            boost::bind(&TcpClient::handleFdRecvSub, this,
+                boost::asio::placeholders::error));
+}
+
 void TcpClient::listRequest() {
     std::ostream requestStream(&request);
     requestStream << "l\n\n";
@@ -94,32 +169,72 @@ void TcpClient::listRequest() {
                 boost::asio::placeholders::error));
 }
 
+void TcpClient::copyRequest(const std::string& srcPath, const std::string& dstPath,
+        bool move) {
+    // The server copies or renames the file itself
+    std::ostream requestStream(&request);
+    requestStream << (move ? "m" : "c") << "\n" << srcPath << "\n"
+        << dstPath << "\n\n";
+
+    async_write(socket, request,
+            boost::bind(&TcpClient::handleCopyAckSub, this,
+                boost::asio::placeholders::error));
+}
+
+void TcpClient::finishFileSend() {
+    upFile.close();
+
+    // Also reached on read errors, the next request must not sit in the cork
+    if (options.cork)
+        setCork(socket.native_handle(), false);
+}
+
 void TcpClient::handleFileSend(const boost::system::error_code& error) {
     if (!error) {
-        upFile.read(buf.c_array(), (std::streamsize)buf.size());
+        chunkSizer.complete(socket.native_handle());
 
-        std::streamsize bytesRead = upFile.gcount();
-        bytesReadTotal += bytesRead;
-
-        if (bytesRead < 0) {
-            std::cerr << "File read error" << std::endl;
-            upFile.close();
-            return;
-        } else if (bytesRead == 0) {
-            upFile.close();
+        if (sendEncoder.done()) {
+            finishFileSend();
             std::cout << "Done" << std::endl;
             requestToServer();
             return;
         }
 
-//        std::cout << "Send " << bytesRead << "bytes, total "
-//            << bytesReadTotal << "bytes" << std::endl;
+        sendRecords.clear();
+
+        if (!sendCursor.done()) {
+            std::size_t offset = sendCursor.offset();
+            std::size_t chunkSize = sendCursor.chunk(chunkSizer.size());
+
+            upFile.seekg(offset);
+            upFile.read(buf.data(), (std::streamsize)chunkSize);
 
-        async_write(socket, boost::asio::buffer(buf.c_array(), bytesRead),
-                boost::asio::transfer_exactly(bytesRead),
+            std::streamsize bytesRead = upFile.gcount();
+            bytesReadTotal += bytesRead;
+
+            if (bytesRead != (std::streamsize)chunkSize) {
+                std::cerr << "File read error" << std::endl;
+                finishFileSend();
+                return;
+            }
+
+            sendCursor.advance(chunkSize);
+            sendEncoder.data(sendRecords, offset, buf.data(), chunkSize);
+
+//            std::cout << "Send " << bytesRead << "bytes, total "
+//                << bytesReadTotal << "bytes" << std::endl;
+        }
+
+        if (sendCursor.done())
+            sendEncoder.finish(sendRecords, sendSize);
+
+        chunkSizer.begin(sendRecords.size());
+        async_write(socket, boost::asio::buffer(sendRecords),
+                boost::asio::transfer_exactly(sendRecords.size()),
                 boost::bind(&TcpClient::handleFileSend, this,
                     boost::asio::placeholders::error));
     } else {
+        finishFileSend();
         std::cerr << "Error: " << error.message() << std::endl;
     }
 }
@@ -139,82 +254,173 @@ void TcpClient::handleFileRecvAck(const boost::system::error_code& error) {
         std::istream ackStream(&ack);
 //        std::cout << "Ack size: " << ack.size() << "bytes" << std::endl;
 
-        std::size_t fileSize;
-        ackStream >> fileSize;
-        ackStream.read(buf.c_array(), 2);
+        ackStream >> recvSize;
+        ackStream.read(buf.data(), 2);
+
+        recvOffset = 0;
+        recvRemain = 0;
+        readRecordHeader();
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+    }
+}
+
+void TcpClient::readRecordHeader() {
+    if (recvOffset == recvSize)
+        return finishFileRecv();
+
+    async_read_until(socket, ack, "\n",
+            boost::bind(&TcpClient::handleRecordHeader, this,
+                boost::asio::placeholders::error));
+}
+
+void TcpClient::handleRecordHeader(const boost::system::error_code& error) {
+    if (!error) {
+        std::istream ackStream(&ack);
+        bool hole;
+        std::size_t length;
+
+        if (!readRecord(ackStream, hole, length) || length > recvSize - recvOffset) {
+            std::cerr << "Invalid record from server" << std::endl;
+            downFile.close();
+            return;
+        }
+
+        // Holes are skipped, the file stays sparse
+        if (hole) {
+            recvOffset += length;
+            return readRecordHeader();
+        }
 
-        std::streamsize bytesRead = 0;
+        recvRemain = length;
 
         // ack stream ܿ Ʈ Ͽ 
         // async_read_until ۶
-        do {
-            ackStream.read(buf.c_array(), (std::streamsize)buf.size());
-            bytesRead += ackStream.gcount();
-//            std::cout << "Writes " << ackStream.gcount() << "bytes, total "
-//                << bytesRead << "bytes" << std::endl;
-            downFile.write(buf.c_array(), ackStream.gcount());
-        } while (ackStream.gcount() > 0);
-
-        std::size_t remainBytes = fileSize - bytesRead;
-
-        if (remainBytes == 0) {
-            //  
-            downFile.close();
-            std::cout << "Done" << std::endl;
-            return requestToServer();
-        } else if (remainBytes >= buf.size()) {
-            // о    buf.size() ũų 
-            async_read(socket, boost::asio::buffer(buf.c_array(), buf.size()),
-                    boost::bind(&TcpClient::handleFileRecv, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
-        } else {
-            // о    buf.size() 
-            async_read(socket, boost::asio::buffer(buf.c_array(), remainBytes),
-                    boost::bind(&TcpClient::handleFileRecv, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
+        while (recvRemain > 0 && ack.size() > 0) {
+            ackStream.read(buf.data(),
+                    (std::streamsize)std::min(buf.size(),
+                        std::min(recvRemain, ack.size())));
+//            std::cout << "Writes " << ackStream.gcount() << "bytes" << std::endl;
+            writeFileData(buf.data(), ackStream.gcount());
         }
+
+        readFileData();
     } else {
         std::cerr << "Error: " << error.message() << std::endl;
     }
 }
 
 void TcpClient::handleFileRecv(const boost::system::error_code& error,
-        const std::size_t bytesTransferred, const std::size_t fileSize) {
+        const std::size_t bytesTransferred) {
     if (!error) {
-        if (bytesTransferred >= 0) {
-            downFile.write(buf.c_array(), (std::streamsize)bytesTransferred);
-//            std::cout << "Writes " << bytesTransferred << "bytes, total "
-//                << downFile.tellp() << "bytes" << std::endl;
-
-            if (downFile.tellp() >= (std::streamsize)fileSize) {
-                downFile.close();
-                std::cout << "Done" << std::endl;
-                return requestToServer();
-            }
-        }
+        writeFileData(buf.data(), bytesTransferred);
+//        std::cout << "Writes " << bytesTransferred << "bytes, "
+//            << recvSize - recvOffset << "bytes left" << std::endl;
 
-        std::size_t remainBytes = fileSize - downFile.tellp();
-
-        if (remainBytes >= buf.size()) {
-            // о    buf.size() ŭ
-            async_read(socket, boost::asio::buffer(buf.c_array(), buf.size()),
-                    boost::bind(&TcpClient::handleFileRecv, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
-        } else {
-            // о    buf.size() 
-            async_read(socket, boost::asio::buffer(buf.c_array(), remainBytes),
-                    boost::bind(&TcpClient::handleFileRecv, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
+        readFileData();
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+    }
+}
+
+void TcpClient::writeFileData(const char* data, std::size_t size) {
+    downFile.seekp(recvOffset);
+    downFile.write(data, size);
+    recvOffset += size;
+    recvRemain -= size;
+}
+
+void TcpClient::readFileData() {
+    if (recvRemain == 0)
+        return readRecordHeader();
+
+    async_read(socket, boost::asio::buffer(buf.data(),
+                std::min(buf.size(), recvRemain)),
+            boost::bind(&TcpClient::handleFileRecv, this,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+}
+
+void TcpClient::finishFileRecv() {
+    downFile.close();
+    // Holes were never written, restore the full size
+    if (truncate(downFilePath.c_str(), recvSize) < 0)
+        std::cerr << "Failed to resize " << downFilePath << std::endl;
+    std::cout << "Done" << std::endl;
+    requestToServer();
+}
+
+void TcpClient::handleFdRecvSub(const boost::system::error_code& error) {
+    if (!error) {
+        // The descriptor only arrives with recvmsg, wait instead of reading
+        socket.async_wait(boost::asio::socket_base::wait_read,
+                boost::bind(&TcpClient::handleFdRecv, this,
+                    boost::asio::placeholders::error));
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+        finishFdRecv(false);
+    }
+}
+
+void TcpClient::handleFdRecv(const boost::system::error_code& error) {
+    if (!error) {
+        char data[64];
+        int fd = -1;
+        ssize_t bytesReceived = recvFd(socket.native_handle(), data, sizeof(data), fd);
+
+        if (fd >= 0)
+            passedFd = fd;
+
+        if (bytesReceived > 0)
+            fdAck.append(data, bytesReceived);
+
+        if ((bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                || (bytesReceived > 0 && fdAck.find("\n\n") == std::string::npos)) {
+            return handleFdRecvSub(error);
+        } else if (bytesReceived <= 0) {
+            std::cerr << "Error: connection closed" << std::endl;
+            return finishFdRecv(false);
         }
+
+        // Packed files come with their offset inside the pack
+        std::istringstream ackStream(fdAck);
+        std::size_t fileSize = 0;
+        std::size_t fileOffset = 0;
+
+        ackStream >> fileSize;
+        bool packed = static_cast<bool>(ackStream >> fileOffset);
+
+        // Whole files are reflinked where the filesystem allows it, a
+        // packed file is only a range of the descriptor
+        bool copied = passedFd >= 0
+            && ((!packed && cloneFile(passedFd, downFd))
+                    || copyFileData(passedFd, fileOffset, downFd, fileSize));
+
+        if (copied)
+            copied = rename(downTempPath.c_str(), downFilePath.c_str()) == 0;
+
+        std::cout << (copied ? "Done" : "Failed") << std::endl;
+        finishFdRecv(copied);
+
+        return requestToServer();
     } else {
         std::cerr << "Error: " << error.message() << std::endl;
+        finishFdRecv(false);
     }
 }
 
+void TcpClient::finishFdRecv(bool copied) {
+    if (passedFd >= 0)
+        close(passedFd);
+    close(downFd);
+    passedFd = -1;
+    downFd = -1;
+
+    // Only the temporary file is removed, the old download stays intact
+    if (!copied)
+        unlink(downTempPath.c_str());
+}
+
 void TcpClient::handleListAckSub(const boost::system::error_code& error) {
     if (!error) {
         async_read_until(socket, ack, "\n\n",
@@ -249,7 +455,37 @@ void TcpClient::handleListAck(const boost::system::error_code& error) {
             std::cout << fileName << fileSize << std::endl;
         }
 
-        ackStream.read(buf.c_array(), 2);
+        ackStream.read(buf.data(), 2);
+        return requestToServer();
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+    }
+}
+
+void TcpClient::handleCopyAckSub(const boost::system::error_code& error) {
+    if (!error) {
+        async_read_until(socket, ack, "\n\n",
+                boost::bind(&TcpClient::handleCopyAck, this,
+                    boost::asio::placeholders::error));
+    } else {
+        std::cerr << "Error: " << error.message() << std::endl;
+    }
+}
+
+void TcpClient::handleCopyAck(const boost::system::error_code& error) {
+    if (!error) {
+        std::istream ackStream(&ack);
+        std::string result;
+
+        // "ok", or "error" followed by the reason
+        std::getline(ackStream, result);
+        ackStream.read(buf.data(), 1);
+
+        if (result == "ok")
+            std::cout << "Done" << std::endl;
+        else
+            std::cout << "Failed: " << result << std::endl;
+
         return requestToServer();
     } else {
         std::cerr << "Error: " << error.message() << std::endl;
@@ -297,6 +533,15 @@ void TcpClient::requestToServer() {
         return fileRecvRequest(fileName);
     }
 
+    // Copy or move on the server, "name" or "user/name"
+    if (operation == "copy" or operation == "cp"
+            or operation == "move" or operation == "mv") {
+        std::string dstPath;
+        std::cin >> fileName >> dstPath;
+        return copyRequest(fileName, dstPath,
+                operation == "move" or operation == "mv");
+    }
+
     // Wrong Operation
     std::cout << "Wrong operation, please try again" << std::endl;
     requestToServer();
@@ -304,18 +549,32 @@ void TcpClient::requestToServer() {
 
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cout << "Usage: ip port#" << std::endl;
+    if (argc < 3) {
+        std::cout << "Usage: ip port# [options]\n"
+            << "       unix path [options]\n" << socketOptionsUsage();
         return 0;
     }
 
+    SocketOptions options;
+
+    for (int i = 3; i < argc; ) {
+        int consumed = parseSocketOption(argc, argv, i, options);
+        if (consumed == 0) {
+            std::cout << "Unknown option " << argv[i] << "\n"
+                << "Usage: ip port# [options]\n"
+                << "       unix path [options]\n" << socketOptionsUsage();
+            return 0;
+        }
+        i += consumed;
+    }
+
     std::string userName;
 
     std::cout << "Username: ";
     std::cin >> userName;
 
     boost::asio::io_service ioService;
-    TcpClient client(ioService, userName, argv[1], argv[2]);
+    TcpClient client(ioService, userName, argv[1], argv[2], options);
     ioService.run();
 
     return 0;
@@ -1,31 +1,54 @@
 #ifndef FILESERVER_CLIENT
 #define FILESERVER_CLIENT
 
+#include <vector>
 #include <fstream>
 #include <boost/asio.hpp>
-#include <boost/array.hpp>
+#include "sparse.hpp"
+#include "sockopt.hpp"
+#include "fdpass.hpp"
 
 
 class TcpClient {
     private:
         const std::string userName;
+        const SocketOptions options;
+        ChunkSizer chunkSizer;
 
         boost::asio::ip::tcp::resolver resolver;
-        boost::asio::ip::tcp::socket socket;
+        // TCP, or a Unix domain socket when localSocket is set
+        boost::asio::generic::stream_protocol::socket socket;
+        const bool localSocket;
 
         boost::asio::streambuf request;
         boost::asio::streambuf ack;
 
         std::ifstream upFile;
         std::ofstream downFile;
+        std::string downFilePath;
 
-        boost::array<char, 4096> buf;
+        ExtentCursor sendCursor;
+        RecordEncoder sendEncoder;
+        std::string sendRecords;
+        std::size_t sendSize;
+
+        std::size_t recvOffset;
+        std::size_t recvRemain;
+        std::size_t recvSize;
+
+        std::vector<char> buf;
 
         std::streamsize bytesReadTotal;
 
+        int downFd;
+        std::string downTempPath;
+        int passedFd;
+        std::string fdAck;
+
     public:
         TcpClient(boost::asio::io_service& ioService, const std::string& _userName,
-                const std::string& server, const std::string& port);
+                const std::string& server, const std::string& port,
+                const SocketOptions& _options);
 
         void handleResolve(const boost::system::error_code& error,
                 boost::asio::ip::tcp::resolver::iterator myIterator);
@@ -33,25 +56,54 @@ class TcpClient {
         void handleConnect(const boost::system::error_code& error,
                 boost::asio::ip::tcp::resolver::iterator myIterator);
 
+        void handleLocalConnect(const boost::system::error_code& error);
+
         void fileSendRequest(const std::string& fileName);
 
         void fileRecvRequest(const std::string& fileName);
 
+        void fileRecvLocalRequest(const std::string& fileName);
+
         void listRequest();
 
+        void copyRequest(const std::string& srcPath, const std::string& dstPath,
+                bool move);
+
+        void finishFileSend();
+
         void handleFileSend(const boost::system::error_code& error);
 
         void handleFileRecvAckSub(const boost::system::error_code& error);
 
         void handleFileRecvAck(const boost::system::error_code& error);
 
+        void readRecordHeader();
+
+        void handleRecordHeader(const boost::system::error_code& error);
+
         void handleFileRecv(const boost::system::error_code& error,
-                const std::size_t bytesTransferred, const std::size_t fileSize);
+                const std::size_t bytesTransferred);
+
+        void writeFileData(const char* data, std::size_t size);
+
+        void readFileData();
+
+        void finishFileRecv();
+
+        void handleFdRecvSub(const boost::system::error_code& error);
+
+        void handleFdRecv(const boost::system::error_code& error);
+
+        void finishFdRecv(bool copied);
 
         void handleListAckSub(const boost::system::error_code& error);
 
         void handleListAck(const boost::system::error_code& error);
 
+        void handleCopyAckSub(const boost::system::error_code& error);
+
+        void handleCopyAck(const boost::system::error_code& error);
+
         void userNameRequest();
 
         void requestToServer();
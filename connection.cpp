@@ -1,9 +1,34 @@
 #include "connection.hpp"
+#include <sstream>
+#include <cerrno>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/bind.hpp>
 
-TcpConnection::TcpConnection(boost::asio::io_service& ioService)
-    : mySocket(ioService) {}
+static const std::size_t copyStepSize = 4 * 1024 * 1024;
+
+
+// Copies in progress, hidden from listings until renamed into place
+static const std::string copyTempPrefix = ".copy-";
+
+
+static bool isValidName(const std::string& name) {
+    return !name.empty() && name.find('/') == std::string::npos
+        && name != "." && name != ".." && name != ".pack"
+        && name.compare(0, copyTempPrefix.size(), copyTempPrefix) != 0;
+}
+
+TcpConnection::TcpConnection(boost::asio::io_service& _ioService,
+        const SocketOptions& _options, Replicator& _replicator,
+        PackStore& _packStore)
+    : replicaPeer(false), ioService(_ioService), mySocket(_ioService),
+    recvOffset(0), recvRemain(0), recvSize(0), sendSize(0), options(_options),
+    chunkSizer(_options), replicator(_replicator), packStore(_packStore),
+    packing(false), sendPacked(false), buf(_options.maxChunkSize), passFd(-1),
+    copyMove(false), copySrcFd(-1), copyDstFd(-1), copySize(0) {}
 
     void TcpConnection::start() {
         std::cout << __FUNCTION__ << std::endl;
@@ -13,7 +38,7 @@ TcpConnection::TcpConnection(boost::asio::io_service& ioService)
                     boost::asio::placeholders::bytes_transferred));
     }
 
-boost::asio::ip::tcp::socket& TcpConnection::socket() {
+boost::asio::generic::stream_protocol::socket& TcpConnection::socket() {
     return mySocket;
 }
 
@@ -31,7 +56,15 @@ void TcpConnection::handleUserName(const boost::system::error_code& error,
     std::istream requestStream(&request);
 
     requestStream >> this->userName;
-    requestStream.read(buf.c_array(), 2);
+    requestStream.get();
+
+    // Peer servers add the replica token on a second line
+    std::string token;
+    if (requestStream.peek() != '\n')
+        std::getline(requestStream, token);
+    requestStream.get();
+
+    replicaPeer = userName == replicaUserName && replicator.acceptsToken(token);
 
     // User name   ٸ !
     mkdir(userName.c_str(), 0777);
@@ -62,85 +95,155 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
     std::size_t fileSize;
 
     requestStream >> operation;
-    if (operation == "u") {
+    if (operation == "u" or operation == "r") {
+        std::string fileUser = userName;
+
+        // Uploads replicated from a peer server name their owner first
+        if (operation == "r") {
+            requestStream >> fileUser;
+
+            if (!replicaPeer || !isValidName(fileUser)) {
+                std::cerr << "Error in " << __FUNCTION__ << ": replica upload for "
+                    << fileUser << " refused" << std::endl;
+                return;
+            }
+            mkdir(fileUser.c_str(), 0777);
+        }
+
         requestStream >> fileName;
         requestStream >> fileSize;
-        requestStream.read(buf.c_array(), 2);
-
-        std::streamsize bytesRead = 0;
+        requestStream.read(buf.data(), 2);
 
         //std::cout << fileName << " size is " << fileSize << std::endl;
         std::size_t pos = fileName.find_last_of('/');
         if (pos != std::string::npos)
             fileName = fileName.substr(pos + 1);
+
+        if (!isValidName(fileName)) {
+            std::cerr << "Error in " << __FUNCTION__ << ": invalid file name "
+                << fileName << std::endl;
+            return;
+        }
+
         std::cout << "Request for upload " << fileName << ": "
             << fileSize << "bytes" << std::endl;
 
-        std::string filePath = root + fileName;
-        outFile.open(filePath.c_str(), std::ios_base::binary);
-
-        // request stream ܿ Ʈ Ͽ 
-        // async_read_until ۶
-        do {
-            requestStream.read(buf.c_array(), (std::streamsize)buf.size());
-            bytesRead += requestStream.gcount();
-            std::cout << __FUNCTION__ << " writes " <<
-                requestStream.gcount() << "bytes, total " << bytesRead
-                << "bytes" << std::endl;
-            outFile.write(buf.c_array(), requestStream.gcount());
-        } while (requestStream.gcount() > 0);
-
-        std::size_t remainBytes = fileSize - bytesRead;
-
-        if (remainBytes == 0) {
-            //  
-            outFile.close();
-            async_read_until(mySocket, request, "\n\n",
-                    boost::bind(&TcpConnection::handleRequest,
-                        shared_from_this(), boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
-        } else if (remainBytes >= buf.size()) {
-            // о    buf.size() ũų 
-            async_read(mySocket, boost::asio::buffer(buf.c_array(), buf.size()),
-                    boost::bind(&TcpConnection::handleFileRecv,
-                        shared_from_this(), boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
+        outFilePath = fileUser + "/" + fileName;
+        packing = packStore.accepts(fileSize);
+
+        if (packing) {
+            packData.assign(fileSize, '\0');
+            packUser = fileUser;
+            packName = fileName;
         } else {
-            // о    buf.size() 
-            async_read(mySocket, boost::asio::buffer(buf.c_array(), remainBytes),
-                    boost::bind(&TcpConnection::handleFileRecv,
-                        shared_from_this(), boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred, fileSize));
+            packStore.remove(fileUser, fileName);
+            outFile.open(outFilePath.c_str(), std::ios_base::binary);
         }
+
+        recvOffset = 0;
+        recvRemain = 0;
+        recvSize = fileSize;
+
+        // Replicas are not forwarded again
+        if (operation == "u")
+            replicaFile = replicator.beginFile(fileUser, fileName, fileSize);
+
+        readRecordHeader();
     } else if (operation == "d") {
         requestStream >> fileName;
-        requestStream.read(buf.c_array(), 2);
+        requestStream.read(buf.data(), 2);
 
         std::string filePath = root + fileName;
-        inFile.open(filePath.c_str(),
-                std::ios_base::binary | std::ios_base::ate);
+        PackEntry entry;
 
-        if (!inFile) {
-            std::cerr << "Error in " << __FUNCTION__ << ": failed to open file" << std::endl;
-            return;
+        sendPacked = packStore.lookup(userName, fileName, entry);
+        if (sendPacked) {
+            if (!packStore.read(userName, entry, packData)) {
+                std::cerr << "Error in " << __FUNCTION__ << ": failed to read packed file" << std::endl;
+                return;
+            }
+
+            sendSize = packData.size();
+            sendCursor.reset(ExtentList(1, Extent(0, sendSize)));
+        } else {
+            inFile.open(filePath.c_str(),
+                    std::ios_base::binary | std::ios_base::ate);
+
+            if (!inFile) {
+                std::cerr << "Error in " << __FUNCTION__ << ": failed to open file" << std::endl;
+                return;
+            }
+
+            sendSize = inFile.tellg();
+            inFile.seekg(0);
+            sendCursor.reset(mapHoleExtents(filePath, sendSize));
         }
 
-        std::size_t fileSize = inFile.tellg();
-        inFile.seekg(0);
+        std::cout << "Request for download " << fileName << ": "
+            << sendSize << "bytes, " << sendCursor.remain()
+            << "bytes in data regions" << std::endl;
 
         bytesReadTotal = 0;
+        sendEncoder.reset();
 
+        // Zero blocks are found chunk by chunk, the ack only carries the size
         std::ostream ackStream(&ack);
-        std::cout << "Request for download " << fileName << ": "
-            << fileSize << "bytes" << std::endl;
+        ackStream << sendSize << "\n\n";
 
-        ackStream << fileSize << "\n\n";
+        // Hold the ack back until the first data chunk fills the segment
+        if (options.cork)
+            setCork(mySocket.native_handle(), true);
 
         async_write(mySocket, ack,
                 boost::bind(&TcpConnection::handleFileSend,
                     shared_from_this(), boost::asio::placeholders::error));
+    } else if (operation == "f") {
+        // Download by descriptor, the local client copies the file itself
+        requestStream >> fileName;
+        requestStream.read(buf.data(), 2);
+
+        std::string filePath = root + fileName;
+        struct stat fileStat;
+        std::size_t fileSize = 0;
+        std::size_t fileOffset = 0;
+        bool packed = false;
+        PackEntry entry;
+
+        passFd = -1;
+        if (!isLocalSocket(mySocket.native_handle())) {
+            // Descriptors only pass over a Unix domain socket
+        } else if (packStore.lookup(userName, fileName, entry)) {
+            // The client copies its range out of the pack file
+            passFd = packStore.descriptor(userName, entry);
+            fileSize = entry.length;
+            fileOffset = entry.offset;
+            packed = true;
+        } else {
+            passFd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (passFd >= 0 && fstat(passFd, &fileStat) == 0) {
+                fileSize = fileStat.st_size;
+            } else if (passFd >= 0) {
+                close(passFd);
+                passFd = -1;
+            }
+        }
+
+        std::cout << "Request for local download " << fileName << ": "
+            << fileSize << "bytes" << std::endl;
+
+        // Size 0 without a descriptor tells the client the open failed,
+        // packed files always add their offset inside the pack
+        std::ostringstream ackStream;
+        ackStream << fileSize;
+        if (packed)
+            ackStream << " " << fileOffset;
+        ackStream << "\n\n";
+        fdAck = ackStream.str();
+
+        handleFdSend(boost::system::error_code());
     } else if (operation == "l") {
-        requestStream.read(buf.c_array(), 2);
+        requestStream.read(buf.data(), 2);
 
         DIR *dir;
         struct dirent *ent;
@@ -148,6 +251,9 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
         std::size_t fileSize;
         int fileCount = 0;
         std::string fileName, filePath;
+        std::vector<std::pair<std::string, std::size_t> > packedFiles;
+
+        packStore.list(userName, packedFiles);
 
         if ((dir = opendir(root.c_str())) == NULL) {
             std::cerr << "opendir error" << std::endl;
@@ -155,10 +261,13 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
         }
 
         while ((ent = readdir(dir)) != NULL) {
-            if (strcmp(ent->d_name, ".") == 0 or strcmp(ent->d_name, "..") == 0)
+            if (strcmp(ent->d_name, ".") == 0 or strcmp(ent->d_name, "..") == 0
+                    or strcmp(ent->d_name, ".pack") == 0
+                    or strncmp(ent->d_name, copyTempPrefix.c_str(), copyTempPrefix.size()) == 0)
                 continue;
             fileCount++;
         }
+        fileCount += packedFiles.size();
 
         closedir(dir);
 
@@ -170,6 +279,10 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
                 fileName = ent->d_name;
                 filePath = root + fileName;
 
+                if (fileName == ".pack"
+                        || fileName.compare(0, copyTempPrefix.size(), copyTempPrefix) == 0)
+                    continue;
+
                 fp = fopen(filePath.c_str(), "rb");
                 fseek(fp, 0, SEEK_END);
                 fileSize = ftell(fp);
@@ -180,6 +293,11 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
 
                 ackStream << fileName << "\n" << fileSize << "\n";
             }
+
+            for (std::size_t i = 0; i < packedFiles.size(); i++) {
+                ackStream << packedFiles[i].first << "\n"
+                    << packedFiles[i].second << "\n";
+            }
             ackStream << "\n";
             closedir(dir);
         } else {
@@ -190,24 +308,42 @@ void TcpConnection::handleRequest(const boost::system::error_code& error,
         async_write(mySocket, ack,
                 boost::bind(&TcpConnection::handleList,
                     shared_from_this(), boost::asio::placeholders::error));
+    } else if (operation == "c" or operation == "m") {
+        // Server-side copy or move, the data never leaves the server
+        std::string srcPath, dstPath;
+
+        requestStream >> srcPath;
+        requestStream >> dstPath;
+        requestStream.read(buf.data(), 2);
+
+        std::cout << "Request for " << (operation == "m" ? "move " : "copy ")
+            << srcPath << " to " << dstPath << std::endl;
+
+        startCopy(operation == "m", srcPath, dstPath);
     }
 }
 
+void TcpConnection::finishFileSend() {
+    if (sendPacked)
+        packData.clear();
+    else
+        inFile.close();
+
+    // Shared by completion and failure, so a reply that follows is never corked
+    if (options.cork)
+        setCork(mySocket.native_handle(), false);
+}
+
 void TcpConnection::handleFileSend(const boost::system::error_code& error) {
     if (error) {
+        finishFileSend();
         return handleError(__FUNCTION__, error);
     }
-    inFile.read(buf.c_array(), (std::streamsize)buf.size());
 
-    std::streamsize bytesRead = inFile.gcount();
-    bytesReadTotal += bytesRead;
+    chunkSizer.complete(mySocket.native_handle());
 
-    if (bytesRead < 0) {
-        std::cerr << "File read error" << std::endl;
-        inFile.close();
-        return;
-    } else if (bytesRead == 0) {
-        inFile.close();
+    if (sendEncoder.done()) {
+        finishFileSend();
         async_read_until(mySocket, request, "\n\n",
                 boost::bind(&TcpConnection::handleRequest,
                     shared_from_this(), boost::asio::placeholders::error,
@@ -215,52 +351,212 @@ void TcpConnection::handleFileSend(const boost::system::error_code& error) {
         return;
     }
 
-    std::cout << __FUNCTION__ << " reads " << bytesRead << "bytes, total "
-        << bytesReadTotal << "bytes" << std::endl;
+    sendRecords.clear();
+
+    if (!sendCursor.done()) {
+        std::size_t offset = sendCursor.offset();
+        std::size_t chunkSize = sendCursor.chunk(chunkSizer.size());
+        const char* data = buf.data();
+
+        if (sendPacked) {
+            data = packData.data() + offset;
+        } else {
+            inFile.seekg(offset);
+            inFile.read(buf.data(), (std::streamsize)chunkSize);
 
+            if (inFile.gcount() != (std::streamsize)chunkSize) {
+                std::cerr << "File read error" << std::endl;
+                finishFileSend();
+                return;
+            }
+        }
+
+        sendCursor.advance(chunkSize);
+        bytesReadTotal += chunkSize;
+
+        // An all-zero chunk only grows the pending hole, nothing is written
+        sendEncoder.data(sendRecords, offset, data, chunkSize);
+
+        std::cout << __FUNCTION__ << " reads " << chunkSize << "bytes, total "
+            << bytesReadTotal << "bytes" << std::endl;
+    }
+
+    if (sendCursor.done())
+        sendEncoder.finish(sendRecords, sendSize);
+
+    chunkSizer.begin(sendRecords.size());
     async_write(mySocket,
-            boost::asio::buffer(buf.c_array(), bytesRead),
-            boost::asio::transfer_exactly(bytesRead),
+            boost::asio::buffer(sendRecords),
+            boost::asio::transfer_exactly(sendRecords.size()),
             boost::bind(&TcpConnection::handleFileSend, shared_from_this(),
                 boost::asio::placeholders::error));
 }
 
+void TcpConnection::readRecordHeader() {
+    if (recvOffset == recvSize)
+        return finishFileRecv();
+
+    async_read_until(mySocket, request, "\n",
+            boost::bind(&TcpConnection::handleRecordHeader,
+                shared_from_this(), boost::asio::placeholders::error));
+}
+
+void TcpConnection::handleRecordHeader(const boost::system::error_code& error) {
+    if (error) {
+        abortFileRecv();
+        return handleError(__FUNCTION__, error);
+    }
+
+    std::istream requestStream(&request);
+    bool hole;
+    std::size_t length;
+
+    // Records past the announced size are refused, the rest of the stream
+    // cannot be skipped so the connection is dropped
+    if (!readRecord(requestStream, hole, length) || length > recvSize - recvOffset) {
+        std::cerr << "Error in " << __FUNCTION__ << ": invalid record for "
+            << outFilePath << std::endl;
+        abortFileRecv();
+        return;
+    }
+
+    // Nothing is written for holes, seeking past them keeps the file sparse
+    if (hole) {
+        recvOffset += length;
+        return readRecordHeader();
+    }
+
+    recvRemain = length;
+
+    // request stream ܿ Ʈ Ͽ 
+    // async_read_until ۶
+    while (recvRemain > 0 && request.size() > 0) {
+        requestStream.read(buf.data(),
+                (std::streamsize)std::min(buf.size(),
+                    std::min(recvRemain, request.size())));
+        writeFileData(buf.data(), requestStream.gcount());
+    }
+
+    readFileData();
+}
+
 void TcpConnection::handleFileRecv(const boost::system::error_code& error,
-        std::size_t bytesTransferred, std::size_t fileSize) {
+        std::size_t bytesTransferred) {
     if (error) {
+        abortFileRecv();
         return handleError(__FUNCTION__, error);
     }
 
-    if (bytesTransferred >= 0) {
-        outFile.write(buf.c_array(), (std::streamsize) bytesTransferred);
-        std::cout << __FUNCTION__ << " writes " << bytesTransferred
-            << "bytes, total " << outFile.tellp() << "bytes" << std::endl;
-
-        if (outFile.tellp() >= (std::streamsize)fileSize) {
-            outFile.close();
-            async_read_until(mySocket, request, "\n\n",
-                    boost::bind(&TcpConnection::handleRequest,
-                        shared_from_this(), boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
-            return;
-        }
+    writeFileData(buf.data(), bytesTransferred);
+    std::cout << __FUNCTION__ << " writes " << bytesTransferred
+        << "bytes, " << recvSize - recvOffset << "bytes left" << std::endl;
+
+    readFileData();
+}
+
+void TcpConnection::writeFileData(const char* data, std::size_t size) {
+    if (packing) {
+        memcpy(&packData[recvOffset], data, size);
+    } else {
+        outFile.seekp(recvOffset);
+        outFile.write(data, size);
     }
 
-    std::size_t remainBytes = fileSize - outFile.tellp();
+    if (replicaFile)
+        replicator.appendData(replicaFile, recvOffset, data, size);
 
-    if (remainBytes >= buf.size()) {
-        // о    buf.size() ŭ
-        async_read(mySocket, boost::asio::buffer(buf.c_array(), buf.size()),
-                boost::bind(&TcpConnection::handleFileRecv,
-                    shared_from_this(), boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred, fileSize));
+    recvOffset += size;
+    recvRemain -= size;
+}
+
+void TcpConnection::readFileData() {
+    if (recvRemain == 0)
+        return readRecordHeader();
+
+    // Stop reading while a peer's replication queue is full
+    if (replicaFile && !replicator.writable(replicaFile)) {
+        replicator.waitWritable(replicaFile,
+                boost::bind(&TcpConnection::readFileData, shared_from_this()));
+        return;
+    }
+
+    async_read(mySocket, boost::asio::buffer(buf.data(),
+                std::min(buf.size(), recvRemain)),
+            boost::bind(&TcpConnection::handleFileRecv,
+                shared_from_this(), boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+}
+
+void TcpConnection::finishFileRecv() {
+    if (packing) {
+        if (!packStore.store(packUser, packName, packData))
+            std::cerr << "Error in " << __FUNCTION__ << ": failed to pack "
+                << outFilePath << std::endl;
+        packData.clear();
+        packing = false;
     } else {
-        // о    buf.size() 
-        async_read(mySocket, boost::asio::buffer(buf.c_array(), remainBytes),
-                boost::bind(&TcpConnection::handleFileRecv,
-                    shared_from_this(), boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred, fileSize));
+        outFile.close();
+
+        // A trailing hole is never written, extend the file to its full size
+        if (truncate(outFilePath.c_str(), recvSize) < 0)
+            std::cerr << "Error in " << __FUNCTION__ << ": failed to resize "
+                << outFilePath << std::endl;
+    }
+
+    if (replicaFile) {
+        replicator.endFile(replicaFile);
+        replicaFile.reset();
     }
+
+    async_read_until(mySocket, request, "\n\n",
+            boost::bind(&TcpConnection::handleRequest,
+                shared_from_this(), boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+}
+
+void TcpConnection::abortFileRecv() {
+    if (replicaFile) {
+        replicator.abortFile(replicaFile);
+        replicaFile.reset();
+    }
+
+    packData.clear();
+    packing = false;
+    outFile.close();
+}
+
+void TcpConnection::handleFdSend(const boost::system::error_code& error) {
+    if (error) {
+        if (passFd >= 0)
+            close(passFd);
+        passFd = -1;
+        return handleError(__FUNCTION__, error);
+    }
+
+    ssize_t bytesSent = sendFd(mySocket.native_handle(), fdAck, passFd);
+
+    if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        mySocket.async_wait(boost::asio::socket_base::wait_write,
+                boost::bind(&TcpConnection::handleFdSend,
+                    shared_from_this(), boost::asio::placeholders::error));
+        return;
+    }
+
+    // The client holds its own reference once the message is queued
+    if (passFd >= 0)
+        close(passFd);
+    passFd = -1;
+
+    if (bytesSent != (ssize_t)fdAck.size()) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to send descriptor"
+            << std::endl;
+        return;
+    }
+
+    async_read_until(mySocket, request, "\n\n",
+            boost::bind(&TcpConnection::handleRequest,
+                shared_from_this(), boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
 }
 
 void TcpConnection::handleList(const boost::system::error_code& error) {
@@ -274,6 +570,175 @@ void TcpConnection::handleList(const boost::system::error_code& error) {
                 boost::asio::placeholders::bytes_transferred));
 }
 
+bool TcpConnection::splitPath(const std::string& path, std::string& pathUser,
+        std::string& pathName) const {
+    // "name" is in the own root, "user/name" in the root of another user
+    std::size_t pos = path.find('/');
+    pathUser = pos == std::string::npos ? userName : path.substr(0, pos);
+    pathName = pos == std::string::npos ? path : path.substr(pos + 1);
+
+    return isValidName(pathUser) && isValidName(pathName);
+}
+
+void TcpConnection::startCopy(bool move, const std::string& srcPath,
+        const std::string& dstPath) {
+    struct stat fileStat;
+    PackEntry entry;
+
+    if (!splitPath(srcPath, copySrcUser, copySrcName)
+            || !splitPath(dstPath, copyDstUser, copyDstName))
+        return replyCopy("error invalid path");
+
+    if (copySrcUser == copyDstUser && copySrcName == copyDstName)
+        return replyCopy("error same file");
+
+    if (stat(copyDstUser.c_str(), &fileStat) < 0 || !S_ISDIR(fileStat.st_mode))
+        return replyCopy("error no such user " + copyDstUser);
+
+    copyMove = move;
+    std::string srcFile = copySrcUser + "/" + copySrcName;
+    std::string dstFile = copyDstUser + "/" + copyDstName;
+
+    if (packStore.lookup(copySrcUser, copySrcName, entry)) {
+        bool copied;
+
+        if (move && copySrcUser == copyDstUser) {
+            copied = packStore.rename(copySrcUser, copySrcName, copyDstName);
+        } else {
+            std::string data;
+            copied = packStore.read(copySrcUser, entry, data)
+                && packStore.store(copyDstUser, copyDstName, data);
+            if (copied && move)
+                packStore.remove(copySrcUser, copySrcName);
+        }
+
+        if (!copied)
+            return replyCopy("error failed to copy packed file");
+
+        replicator.queueFile(copyDstUser, copyDstName);
+        return replyCopy("ok");
+    }
+
+    if (move) {
+        if (rename(srcFile.c_str(), dstFile.c_str()) == 0) {
+            packStore.remove(copyDstUser, copyDstName);
+            replicator.queueFile(copyDstUser, copyDstName);
+            return replyCopy("ok");
+        }
+
+        // Across filesystems the file is copied and the source removed
+        if (errno != EXDEV)
+            return replyCopy(std::string("error ") + strerror(errno));
+    }
+
+    copySrcFd = open(srcFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (copySrcFd < 0 || fstat(copySrcFd, &fileStat) < 0) {
+        std::string result = std::string("error ") + strerror(errno);
+        if (copySrcFd >= 0)
+            close(copySrcFd);
+        copySrcFd = -1;
+        return replyCopy(result);
+    }
+
+    // The destination is replaced only once the copy is complete
+    std::string tempTemplate = copyDstUser + "/" + copyTempPrefix + "XXXXXX";
+    std::vector<char> tempPath(tempTemplate.begin(), tempTemplate.end());
+    tempPath.push_back('\0');
+
+    copyDstFd = mkostemp(tempPath.data(), O_CLOEXEC);
+    if (copyDstFd < 0) {
+        std::string result = std::string("error ") + strerror(errno);
+        close(copySrcFd);
+        copySrcFd = -1;
+        return replyCopy(result);
+    }
+
+    copyTempPath = tempPath.data();
+    fchmod(copyDstFd, 0644);
+    copySize = fileStat.st_size;
+
+    // A reflink shares the blocks, nothing is copied at all
+    if (cloneFile(copySrcFd, copyDstFd)) {
+        std::cout << __FUNCTION__ << " cloned " << srcFile << " to "
+            << dstFile << std::endl;
+        return finishCopy(true);
+    }
+
+    copyCursor.reset(mapHoleExtents(copySrcFd, copySize));
+    copyStep();
+}
+
+void TcpConnection::copyStep() {
+    std::size_t bytesCopied = 0;
+
+    while (!copyCursor.done() && bytesCopied < copyStepSize) {
+        std::size_t chunkSize = copyCursor.chunk(copyStepSize - bytesCopied);
+        if (!copyFileRange(copySrcFd, copyCursor.offset(), copyDstFd,
+                    copyCursor.offset(), chunkSize))
+            return finishCopy(false);
+
+        copyCursor.advance(chunkSize);
+        bytesCopied += chunkSize;
+    }
+
+    std::cout << __FUNCTION__ << " copies " << bytesCopied << "bytes, "
+        << copyCursor.remain() << "bytes left" << std::endl;
+
+    // Let the other connections run between steps of a large copy
+    if (!copyCursor.done()) {
+        ioService.post(boost::bind(&TcpConnection::copyStep, shared_from_this()));
+        return;
+    }
+
+    finishCopy(ftruncate(copyDstFd, (off_t)copySize) == 0);
+}
+
+void TcpConnection::finishCopy(bool copied) {
+    std::string srcFile = copySrcUser + "/" + copySrcName;
+    std::string dstFile = copyDstUser + "/" + copyDstName;
+
+    close(copySrcFd);
+    close(copyDstFd);
+    copySrcFd = -1;
+    copyDstFd = -1;
+
+    if (!copied || rename(copyTempPath.c_str(), dstFile.c_str()) < 0) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to copy "
+            << srcFile << " to " << dstFile << std::endl;
+        unlink(copyTempPath.c_str());
+        return replyCopy("error failed to copy");
+    }
+
+    // The regular file shadows a packed one of the same name from now on
+    packStore.remove(copyDstUser, copyDstName);
+
+    if (copyMove)
+        unlink(srcFile.c_str());
+
+    replicator.queueFile(copyDstUser, copyDstName);
+    replyCopy("ok");
+}
+
+void TcpConnection::replyCopy(const std::string& result) {
+    std::ostream ackStream(&ack);
+    ackStream << result << "\n\n";
+
+    async_write(mySocket, ack,
+            boost::bind(&TcpConnection::handleCopyAck,
+                shared_from_this(), boost::asio::placeholders::error));
+}
+
+void TcpConnection::handleCopyAck(const boost::system::error_code& error) {
+    if (error) {
+        return handleError(__FUNCTION__, error);
+    }
+
+    async_read_until(mySocket, request, "\n\n",
+            boost::bind(&TcpConnection::handleRequest,
+                shared_from_this(), boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+}
+
 void TcpConnection::handleError(const std::string& functionName,
         const boost::system::error_code& error) {
     std::cerr << "Error in " << functionName << ": " << error << ": "
@@ -3,50 +3,133 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <fstream>
-#include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include "sparse.hpp"
+#include "sockopt.hpp"
+#include "replicator.hpp"
+#include "packstore.hpp"
+#include "fdpass.hpp"
 
 
 class TcpConnection : public boost::enable_shared_from_this <TcpConnection> {
     private:
         std::string userName;
         std::string root;
+        bool replicaPeer;
 
         boost::asio::streambuf request;
         boost::asio::streambuf ack;
 
-        boost::asio::ip::tcp::socket mySocket;
+        boost::asio::io_service& ioService;
+
+        // TCP or Unix domain socket
+        boost::asio::generic::stream_protocol::socket mySocket;
 
         std::ofstream outFile;
         std::ifstream inFile;
-
-        boost::array<char, 4096> buf;
+        std::string outFilePath;
+
+        // Upload records: file position reached, data left in the current
+        // "D" record and the size the records must add up to
+        std::size_t recvOffset;
+        std::size_t recvRemain;
+        std::size_t recvSize;
+
+        // Download: data regions to read, records to send
+        ExtentCursor sendCursor;
+        RecordEncoder sendEncoder;
+        std::string sendRecords;
+        std::size_t sendSize;
+
+        const SocketOptions& options;
+        ChunkSizer chunkSizer;
+
+        Replicator& replicator;
+        ptrReplicaFile replicaFile;
+
+        // Small uploads are collected here and stored in a pack at the end
+        PackStore& packStore;
+        std::string packData;
+        std::string packUser;
+        std::string packName;
+        bool packing;
+        bool sendPacked;
+
+        std::vector<char> buf;
         std::streamsize bytesReadTotal;
 
+        int passFd;
+        std::string fdAck;
+
+        // Server-side copy or move in progress
+        std::string copySrcUser;
+        std::string copySrcName;
+        std::string copyDstUser;
+        std::string copyDstName;
+        bool copyMove;
+        std::string copyTempPath;
+        int copySrcFd;
+        int copyDstFd;
+        std::size_t copySize;
+        ExtentCursor copyCursor;
+
         void handleUserName(const boost::system::error_code& error,
                 const std::size_t bytesTransferred);
 
         void handleRequest(const boost::system::error_code& error,
                 const std::size_t bytesTransferred);
 
+        void finishFileSend();
+
         void handleFileSend(const boost::system::error_code& error);
 
+        void readRecordHeader();
+
+        void handleRecordHeader(const boost::system::error_code& error);
+
         void handleFileRecv(const boost::system::error_code& error,
-                std::size_t bytesTransferred, std::size_t fileSize);
+                std::size_t bytesTransferred);
+
+        void writeFileData(const char* data, std::size_t size);
+
+        void readFileData();
+
+        void finishFileRecv();
+
+        void abortFileRecv();
+
+        void handleFdSend(const boost::system::error_code& error);
 
         void handleList(const boost::system::error_code& error);
 
+        bool splitPath(const std::string& path, std::string& pathUser,
+                std::string& pathName) const;
+
+        void startCopy(bool move, const std::string& srcPath,
+                const std::string& dstPath);
+
+        void copyStep();
+
+        void finishCopy(bool copied);
+
+        void replyCopy(const std::string& result);
+
+        void handleCopyAck(const boost::system::error_code& error);
+
         void handleError(const std::string& functionName,
                 const boost::system::error_code& error);
 
     public:
-        TcpConnection(boost::asio::io_service& ioService);
+        TcpConnection(boost::asio::io_service& ioService,
+                const SocketOptions& _options, Replicator& _replicator,
+                PackStore& _packStore);
 
         void start();
 
-        boost::asio::ip::tcp::socket& socket();
+        boost::asio::generic::stream_protocol::socket& socket();
 };
 
 #endif
@@ -0,0 +1,68 @@
+#include "fdpass.hpp"
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+bool isLocalSocket(int socketFd) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+
+    if (getsockname(socketFd, (struct sockaddr*)&address, &length) < 0)
+        return false;
+
+    return address.ss_family == AF_UNIX;
+}
+
+ssize_t sendFd(int socketFd, const std::string& data, int fd) {
+    struct msghdr message;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = const_cast<char*>(data.data());
+    iov.iov_len = data.size();
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(socketFd, &message, MSG_NOSIGNAL);
+}
+
+ssize_t recvFd(int socketFd, char* data, std::size_t size, int& fd) {
+    struct msghdr message;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = data;
+    iov.iov_len = size;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(socketFd, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0)
+        return received;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return received;
+}
@@ -0,0 +1,15 @@
+#ifndef FILESERVER_FDPASS
+#define FILESERVER_FDPASS
+
+#include <string>
+
+
+bool isLocalSocket(int socketFd);
+
+// Sends data with fd attached as SCM_RIGHTS, fd < 0 sends the data alone
+ssize_t sendFd(int socketFd, const std::string& data, int fd);
+
+// Receives up to size bytes, fd is set if a descriptor came with them
+ssize_t recvFd(int socketFd, char* data, std::size_t size, int& fd);
+
+#endif
@@ -0,0 +1,409 @@
+#include "packstore.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/bind.hpp>
+
+static const char* packDirName = ".pack";
+static const std::size_t packSizeLimit = 256 * 1024 * 1024;
+const std::size_t packThresholdLimit = packSizeLimit / 16;
+static const std::size_t compactMinSize = 1024 * 1024;
+static const std::size_t compactStepSize = 1024 * 1024;
+static const long compactInterval = 10;
+
+
+PackStore::PackStore(boost::asio::io_service& _ioService, std::size_t _threshold)
+    : threshold(_threshold), ioService(_ioService), compactTimer(_ioService),
+    compacting(false), compactPack(0) {
+        if (threshold > 0)
+            scheduleCompaction();
+}
+
+PackStore::~PackStore() {
+    std::map<std::string, UserPacks>::iterator it;
+    for (it = users.begin(); it != users.end(); ++it) {
+        std::map<unsigned, int>::iterator fd;
+        for (fd = it->second.packFds.begin(); fd != it->second.packFds.end(); ++fd)
+            close(fd->second);
+        if (it->second.indexFd >= 0)
+            close(it->second.indexFd);
+    }
+}
+
+bool PackStore::accepts(std::size_t fileSize) const {
+    return threshold > 0 && fileSize < threshold;
+}
+
+PackStore::UserPacks& PackStore::load(const std::string& userName) {
+    std::map<std::string, UserPacks>::iterator it = users.find(userName);
+    if (it != users.end())
+        return it->second;
+
+    UserPacks& packs = users[userName];
+    packs.packDir = userName + "/" + packDirName;
+    packs.activePack = 1;
+    packs.indexFd = -1;
+
+    DIR *dir;
+    struct dirent *ent;
+
+    if ((dir = opendir(packs.packDir.c_str())) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            char* end;
+            unsigned pack = strtoul(ent->d_name, &end, 10);
+            if (end == ent->d_name || strcmp(end, ".pack") != 0)
+                continue;
+
+            std::ostringstream packPath;
+            packPath << packs.packDir << "/" << ent->d_name;
+
+            struct stat packStat;
+            if (stat(packPath.str().c_str(), &packStat) < 0)
+                continue;
+
+            packs.packSizes[pack] = packStat.st_size;
+            packs.activePack = std::max(packs.activePack, pack);
+        }
+        closedir(dir);
+    }
+
+    // Replay the index log, the last record of a name wins
+    std::ifstream indexFile((packs.packDir + "/index").c_str());
+    std::string operation, fileName;
+
+    while (indexFile >> operation >> fileName) {
+        if (operation == "+") {
+            PackEntry entry;
+            indexFile >> entry.pack >> entry.offset >> entry.length;
+            packs.index[fileName] = entry;
+        } else {
+            packs.index.erase(fileName);
+        }
+    }
+
+    packs.deadBytes = packs.packSizes;
+
+    std::map<std::string, PackEntry>::iterator entry = packs.index.begin();
+    while (entry != packs.index.end()) {
+        std::map<unsigned, std::size_t>::iterator size =
+            packs.packSizes.find(entry->second.pack);
+
+        // Records past the end of a pack were never fully written
+        if (size == packs.packSizes.end()
+                || entry->second.offset + entry->second.length > size->second) {
+            packs.index.erase(entry++);
+            continue;
+        }
+
+        packs.deadBytes[entry->second.pack] -= entry->second.length;
+        ++entry;
+    }
+
+    return packs;
+}
+
+std::string PackStore::packPath(const UserPacks& packs, unsigned pack) const {
+    std::ostringstream path;
+    path << packs.packDir << "/" << pack << ".pack";
+    return path.str();
+}
+
+int PackStore::packFd(UserPacks& packs, unsigned pack) {
+    std::map<unsigned, int>::iterator it = packs.packFds.find(pack);
+    if (it != packs.packFds.end())
+        return it->second;
+
+    std::string path = packPath(packs, pack);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to open "
+            << path << std::endl;
+        return -1;
+    }
+
+    packs.packFds[pack] = fd;
+    return fd;
+}
+
+void PackStore::logEntry(UserPacks& packs, const std::string& fileName,
+        const PackEntry* entry) {
+    if (packs.indexFd < 0) {
+        std::string indexPath = packs.packDir + "/index";
+        packs.indexFd = open(indexPath.c_str(),
+                O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    }
+
+    std::ostringstream record;
+    if (entry != NULL) {
+        record << "+ " << fileName << " " << entry->pack << " "
+            << entry->offset << " " << entry->length << "\n";
+    } else {
+        record << "- " << fileName << "\n";
+    }
+
+    std::string line = record.str();
+    if (packs.indexFd < 0
+            || write(packs.indexFd, line.data(), line.size()) != (ssize_t)line.size()) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to log "
+            << fileName << std::endl;
+    }
+}
+
+void PackStore::dropEntry(UserPacks& packs, const std::string& fileName) {
+    std::map<std::string, PackEntry>::iterator it = packs.index.find(fileName);
+    if (it == packs.index.end())
+        return;
+
+    packs.deadBytes[it->second.pack] += it->second.length;
+    packs.index.erase(it);
+}
+
+bool PackStore::append(UserPacks& packs, const std::string& fileName,
+        const char* data, std::size_t size) {
+    mkdir(packs.packDir.c_str(), 0777);
+
+    if (packs.packSizes[packs.activePack] > 0
+            && packs.packSizes[packs.activePack] + size > packSizeLimit)
+        packs.activePack = packs.packSizes.rbegin()->first + 1;
+
+    int fd = packFd(packs, packs.activePack);
+    if (fd < 0)
+        return false;
+
+    PackEntry entry;
+    entry.pack = packs.activePack;
+    entry.offset = packs.packSizes[packs.activePack];
+    entry.length = size;
+
+    ssize_t bytesWritten = pwrite(fd, data, size, (off_t)entry.offset);
+    if (bytesWritten != (ssize_t)size) {
+        // Whatever made it to the pack is unreachable
+        if (bytesWritten > 0) {
+            packs.packSizes[entry.pack] += bytesWritten;
+            packs.deadBytes[entry.pack] += bytesWritten;
+        }
+        return false;
+    }
+
+    packs.packSizes[entry.pack] += size;
+
+    // Updated in place, compactStep iterates the index while moving entries
+    std::map<std::string, PackEntry>::iterator it = packs.index.find(fileName);
+    if (it != packs.index.end()) {
+        packs.deadBytes[it->second.pack] += it->second.length;
+        it->second = entry;
+    } else {
+        packs.index[fileName] = entry;
+    }
+
+    logEntry(packs, fileName, &entry);
+    return true;
+}
+
+bool PackStore::lookup(const std::string& userName, const std::string& fileName,
+        PackEntry& entry) {
+    UserPacks& packs = load(userName);
+
+    std::map<std::string, PackEntry>::iterator it = packs.index.find(fileName);
+    if (it == packs.index.end())
+        return false;
+
+    entry = it->second;
+    return true;
+}
+
+bool PackStore::read(const std::string& userName, const PackEntry& entry,
+        std::string& data) {
+    UserPacks& packs = load(userName);
+
+    int fd = packFd(packs, entry.pack);
+    if (fd < 0)
+        return false;
+
+    data.resize(entry.length);
+
+    std::size_t bytesReadTotal = 0;
+    while (bytesReadTotal < entry.length) {
+        ssize_t bytesRead = pread(fd, &data[bytesReadTotal],
+                entry.length - bytesReadTotal, (off_t)(entry.offset + bytesReadTotal));
+        if (bytesRead <= 0)
+            return false;
+        bytesReadTotal += bytesRead;
+    }
+
+    return true;
+}
+
+int PackStore::descriptor(const std::string& userName, const PackEntry& entry) {
+    UserPacks& packs = load(userName);
+
+    // The client gets a descriptor of its own, it must not write to the pack
+    return open(packPath(packs, entry.pack).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+bool PackStore::store(const std::string& userName, const std::string& fileName,
+        const std::string& data) {
+    UserPacks& packs = load(userName);
+
+    if (!append(packs, fileName, data.data(), data.size()))
+        return false;
+
+    // A regular file of the same name would shadow the packed one in listings
+    unlink((userName + "/" + fileName).c_str());
+    return true;
+}
+
+bool PackStore::remove(const std::string& userName, const std::string& fileName) {
+    UserPacks& packs = load(userName);
+
+    if (packs.index.find(fileName) == packs.index.end())
+        return false;
+
+    dropEntry(packs, fileName);
+    logEntry(packs, fileName, NULL);
+    return true;
+}
+
+bool PackStore::rename(const std::string& userName, const std::string& fromName,
+        const std::string& toName) {
+    UserPacks& packs = load(userName);
+
+    std::map<std::string, PackEntry>::iterator it = packs.index.find(fromName);
+    if (it == packs.index.end())
+        return false;
+
+    PackEntry entry = it->second;
+    packs.index.erase(it);
+    dropEntry(packs, toName);
+    packs.index[toName] = entry;
+
+    logEntry(packs, toName, &entry);
+    logEntry(packs, fromName, NULL);
+
+    unlink((userName + "/" + toName).c_str());
+    return true;
+}
+
+void PackStore::list(const std::string& userName,
+        std::vector<std::pair<std::string, std::size_t> >& files) {
+    UserPacks& packs = load(userName);
+
+    std::map<std::string, PackEntry>::iterator it;
+    for (it = packs.index.begin(); it != packs.index.end(); ++it)
+        files.push_back(std::make_pair(it->first, it->second.length));
+}
+
+void PackStore::rewriteIndex(const std::string& userName, UserPacks& packs) {
+    std::string indexPath = packs.packDir + "/index";
+    std::string tempPath = indexPath + ".tmp";
+
+    std::ofstream indexFile(tempPath.c_str());
+    std::map<std::string, PackEntry>::iterator it;
+    for (it = packs.index.begin(); it != packs.index.end(); ++it) {
+        indexFile << "+ " << it->first << " " << it->second.pack << " "
+            << it->second.offset << " " << it->second.length << "\n";
+    }
+    indexFile.close();
+
+    if (!indexFile || ::rename(tempPath.c_str(), indexPath.c_str()) < 0) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to rewrite index of "
+            << userName << std::endl;
+        return;
+    }
+
+    // The next record goes to the new index file
+    if (packs.indexFd >= 0)
+        close(packs.indexFd);
+    packs.indexFd = -1;
+}
+
+void PackStore::scheduleCompaction() {
+    compactTimer.expires_from_now(boost::posix_time::seconds(compactInterval));
+    compactTimer.async_wait(boost::bind(&PackStore::handleCompactTimer, this,
+                boost::asio::placeholders::error));
+}
+
+void PackStore::handleCompactTimer(const boost::system::error_code& error) {
+    if (error) {
+        return;
+    }
+
+    std::map<std::string, UserPacks>::iterator it;
+    for (it = users.begin(); it != users.end() && !compacting; ++it) {
+        UserPacks& packs = it->second;
+        std::size_t activeSize = packs.packSizes[packs.activePack];
+
+        // Move on from a mostly dead active pack so that it can be compacted
+        if (activeSize >= compactMinSize
+                && packs.deadBytes[packs.activePack] * 2 >= activeSize)
+            packs.activePack = packs.packSizes.rbegin()->first + 1;
+
+        std::map<unsigned, std::size_t>::iterator size;
+        for (size = packs.packSizes.begin(); size != packs.packSizes.end(); ++size) {
+            if (size->first == packs.activePack || size->second == 0)
+                continue;
+
+            if (packs.deadBytes[size->first] * 2 >= size->second) {
+                compacting = true;
+                compactUser = it->first;
+                compactPack = size->first;
+                ioService.post(boost::bind(&PackStore::compactStep, this));
+                break;
+            }
+        }
+    }
+
+    scheduleCompaction();
+}
+
+void PackStore::compactStep() {
+    UserPacks& packs = load(compactUser);
+    std::size_t bytesMoved = 0;
+    std::string data;
+
+    std::map<std::string, PackEntry>::iterator it;
+    for (it = packs.index.begin(); it != packs.index.end(); ++it) {
+        if (it->second.pack != compactPack)
+            continue;
+
+        PackEntry entry = it->second;
+        if (!read(compactUser, entry, data)
+                || !append(packs, it->first, data.data(), data.size())) {
+            std::cerr << "Error in " << __FUNCTION__ << ": failed to move "
+                << compactUser << "/" << it->first << std::endl;
+            compacting = false;
+            return;
+        }
+
+        // Let the connections run between steps
+        bytesMoved += entry.length;
+        if (bytesMoved >= compactStepSize) {
+            ioService.post(boost::bind(&PackStore::compactStep, this));
+            return;
+        }
+    }
+
+    std::string path = packPath(packs, compactPack);
+
+    std::cout << __FUNCTION__ << " reclaimed " << packs.deadBytes[compactPack]
+        << "bytes from " << path << std::endl;
+
+    if (packs.packFds.count(compactPack)) {
+        close(packs.packFds[compactPack]);
+        packs.packFds.erase(compactPack);
+    }
+    unlink(path.c_str());
+    packs.packSizes.erase(compactPack);
+    packs.deadBytes.erase(compactPack);
+
+    rewriteIndex(compactUser, packs);
+    compacting = false;
+}
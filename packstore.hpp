@@ -0,0 +1,98 @@
+#ifndef FILESERVER_PACKSTORE
+#define FILESERVER_PACKSTORE
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+
+// Largest accepted packing threshold, kept well below the pack size
+extern const std::size_t packThresholdLimit;
+
+struct PackEntry {
+    unsigned pack;
+    std::size_t offset;
+    std::size_t length;
+};
+
+// Small files of a user are appended to userName/.pack/N.pack, and the
+// name -> (pack, offset, length) index is kept in memory and logged to
+// userName/.pack/index. Packs with mostly overwritten entries are
+// compacted into the active pack in small steps on the io_service.
+class PackStore : private boost::noncopyable {
+    private:
+        struct UserPacks {
+            std::map<std::string, PackEntry> index;
+            std::map<unsigned, std::size_t> packSizes;
+            std::map<unsigned, std::size_t> deadBytes;
+            std::map<unsigned, int> packFds;
+            std::string packDir;
+            unsigned activePack;
+            int indexFd;
+        };
+
+        const std::size_t threshold;
+
+        std::map<std::string, UserPacks> users;
+
+        boost::asio::io_service& ioService;
+        boost::asio::deadline_timer compactTimer;
+        bool compacting;
+        std::string compactUser;
+        unsigned compactPack;
+
+        UserPacks& load(const std::string& userName);
+
+        std::string packPath(const UserPacks& packs, unsigned pack) const;
+
+        int packFd(UserPacks& packs, unsigned pack);
+
+        void logEntry(UserPacks& packs, const std::string& fileName,
+                const PackEntry* entry);
+
+        void dropEntry(UserPacks& packs, const std::string& fileName);
+
+        bool append(UserPacks& packs, const std::string& fileName,
+                const char* data, std::size_t size);
+
+        void rewriteIndex(const std::string& userName, UserPacks& packs);
+
+        void scheduleCompaction();
+
+        void handleCompactTimer(const boost::system::error_code& error);
+
+        void compactStep();
+
+    public:
+        PackStore(boost::asio::io_service& _ioService, std::size_t _threshold);
+
+        ~PackStore();
+
+        // True if a file of this size should go into a pack
+        bool accepts(std::size_t fileSize) const;
+
+        bool lookup(const std::string& userName, const std::string& fileName,
+                PackEntry& entry);
+
+        bool read(const std::string& userName, const PackEntry& entry,
+                std::string& data);
+
+        // Read-only descriptor of the pack holding the entry, -1 on failure
+        int descriptor(const std::string& userName, const PackEntry& entry);
+
+        bool store(const std::string& userName, const std::string& fileName,
+                const std::string& data);
+
+        bool remove(const std::string& userName, const std::string& fileName);
+
+        // Moves an entry to a new name of the same user, the data stays put
+        bool rename(const std::string& userName, const std::string& fromName,
+                const std::string& toName);
+
+        void list(const std::string& userName,
+                std::vector<std::pair<std::string, std::size_t> >& files);
+};
+
+#endif
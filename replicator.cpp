@@ -0,0 +1,447 @@
+#include "replicator.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+const char* const replicaUserName = ".replica";
+
+
+PeerLink::PeerLink(boost::asio::io_service& ioService, Replicator& _replicator,
+        PackStore& _packStore, const SocketOptions& _options, const std::string& peer)
+    : replicator(_replicator), packStore(_packStore), options(_options),
+    host(peer.substr(0, peer.find_last_of(':'))),
+    port(peer.find_last_of(':') == std::string::npos ?
+            "" : peer.substr(peer.find_last_of(':') + 1)),
+    resolver(ioService), socket(ioService), reconnectTimer(ioService),
+    connected(false), writing(false), queuedBytes(0), currentLive(false),
+    diskPacked(false), buf(_options.maxChunkSize) {
+        connect();
+}
+
+void PeerLink::connect() {
+    boost::asio::ip::tcp::resolver::query query(host, port);
+    resolver.async_resolve(query, boost::bind(&PeerLink::handleResolve, this,
+                boost::asio::placeholders::error, boost::asio::placeholders::iterator));
+}
+
+void PeerLink::handleResolve(const boost::system::error_code& error,
+        boost::asio::ip::tcp::resolver::iterator myIterator) {
+    if (error) {
+        return handleError(__FUNCTION__, error);
+    }
+
+    boost::asio::async_connect(socket, myIterator,
+            boost::bind(&PeerLink::handleConnect, this,
+                boost::asio::placeholders::error));
+}
+
+void PeerLink::handleConnect(const boost::system::error_code& error) {
+    if (error) {
+        return handleError(__FUNCTION__, error);
+    }
+
+    std::cout << __FUNCTION__ << " replicating to " << host << ":" << port
+        << ", " << pending.size() << " files to catch up" << std::endl;
+
+    applySocketOptions(socket.native_handle(), options);
+    connected = true;
+
+    std::string userName = std::string(replicaUserName) + "\n"
+        + replicator.replicaToken() + "\n\n";
+    chunks.push_back(userName);
+    queuedBytes += userName.size();
+
+    // The peer never answers, a completed read means the link is gone
+    socket.async_read_some(boost::asio::buffer(&probe, 1),
+            boost::bind(&PeerLink::handleProbe, this,
+                boost::asio::placeholders::error));
+
+    writeNext();
+}
+
+void PeerLink::handleProbe(const boost::system::error_code& error) {
+    if (error == boost::asio::error::operation_aborted) {
+        return;
+    }
+
+    handleError(__FUNCTION__, error ? error : boost::asio::error::eof);
+}
+
+void PeerLink::handleWrite(const boost::system::error_code& error) {
+    if (error == boost::asio::error::operation_aborted) {
+        return;
+    }
+
+    writing = false;
+
+    if (error) {
+        return handleError(__FUNCTION__, error);
+    }
+
+    queuedBytes -= chunks.front().size();
+    chunks.pop_front();
+
+    replicator.notify();
+    writeNext();
+}
+
+void PeerLink::handleError(const std::string& functionName,
+        const boost::system::error_code& error) {
+    std::cerr << "Error in " << functionName << " (" << host << ":" << port
+        << "): " << error << ": " << error.message() << std::endl;
+
+    reset();
+
+    reconnectTimer.expires_from_now(boost::posix_time::seconds(1));
+    reconnectTimer.async_wait(boost::bind(&PeerLink::handleReconnect, this,
+                boost::asio::placeholders::error));
+}
+
+void PeerLink::handleReconnect(const boost::system::error_code& error) {
+    if (!error) {
+        connect();
+    }
+}
+
+void PeerLink::reset() {
+    boost::system::error_code ignored;
+    socket.close(ignored);
+
+    connected = false;
+    writing = false;
+    chunks.clear();
+    queuedBytes = 0;
+
+    // Whatever was on the wire is sent again from disk after reconnecting
+    if (current) {
+        pending.push_front(current);
+        current.reset();
+    }
+
+    if (diskFile.is_open())
+        diskFile.close();
+    diskFile.clear();
+    packData.clear();
+
+    replicator.notify();
+}
+
+void PeerLink::queueHeader(const ptrReplicaFile& file) {
+    std::ostringstream header;
+    header << "r\n" << file->userName << "\n" << file->fileName << "\n"
+        << file->fileSize << "\n\n";
+
+    chunks.push_back(header.str());
+    queuedBytes += chunks.back().size();
+}
+
+bool PeerLink::startCatchUp() {
+    // Uploads still in progress wait, the complete ones behind them go first
+    std::deque<ptrReplicaFile>::iterator it = pending.begin();
+    while (it != pending.end() && !(*it)->complete)
+        ++it;
+
+    if (it == pending.end())
+        return false;
+
+    ptrReplicaFile file = *it;
+    pending.erase(it);
+
+    std::string filePath = file->userName + "/" + file->fileName;
+    PackEntry entry;
+
+    if (packStore.lookup(file->userName, file->fileName, entry)) {
+        if (!packStore.read(file->userName, entry, packData)) {
+            std::cerr << "Error in " << __FUNCTION__ << ": failed to read "
+                << filePath << std::endl;
+            return true;
+        }
+
+        current.reset(new ReplicaFile(*file));
+        current->fileSize = packData.size();
+        currentLive = false;
+        diskPacked = true;
+        diskCursor.reset(ExtentList(1, Extent(0, packData.size())));
+        encoder.reset();
+
+        std::cout << __FUNCTION__ << " sends packed " << filePath << " to "
+            << host << ":" << port << std::endl;
+
+        queueHeader(current);
+        return true;
+    }
+
+    diskFile.open(filePath.c_str(), std::ios_base::binary | std::ios_base::ate);
+
+    if (!diskFile) {
+        std::cerr << "Error in " << __FUNCTION__ << ": failed to open "
+            << filePath << std::endl;
+        diskFile.clear();
+        return true;
+    }
+
+    // The file may have changed since it was received, send what is on disk.
+    // Only the holes are mapped, reading the file for zero blocks here would
+    // hold up every connection
+    current.reset(new ReplicaFile(*file));
+    current->fileSize = diskFile.tellg();
+    currentLive = false;
+    diskPacked = false;
+    diskCursor.reset(mapHoleExtents(filePath, current->fileSize));
+    encoder.reset();
+
+    std::cout << __FUNCTION__ << " sends " << filePath << " to "
+        << host << ":" << port << std::endl;
+
+    queueHeader(current);
+    return true;
+}
+
+bool PeerLink::readDiskChunk() {
+    if (encoder.done())
+        return false;
+
+    chunks.push_back(std::string());
+
+    if (diskCursor.done()) {
+        encoder.finish(chunks.back(), current->fileSize);
+        queuedBytes += chunks.back().size();
+        return true;
+    }
+
+    std::size_t offset = diskCursor.offset();
+    std::size_t chunkSize = diskCursor.chunk(buf.size());
+    diskCursor.advance(chunkSize);
+
+    if (diskPacked) {
+        encoder.data(chunks.back(), offset, packData.data() + offset, chunkSize);
+        queuedBytes += chunks.back().size();
+        return true;
+    }
+
+    diskFile.seekg(offset);
+    diskFile.read(buf.data(), (std::streamsize)chunkSize);
+
+    std::streamsize bytesRead = diskFile.gcount();
+    if (bytesRead < (std::streamsize)chunkSize) {
+        // The file shrank, keep the stream in sync with the header
+        std::cerr << "Error in " << __FUNCTION__ << ": short read on "
+            << current->userName << "/" << current->fileName << std::endl;
+        memset(buf.data() + std::max(bytesRead, (std::streamsize)0), 0,
+                chunkSize - std::max(bytesRead, (std::streamsize)0));
+        diskFile.clear();
+    }
+
+    // Zero blocks become holes, a chunk of only zeros queues nothing to send
+    encoder.data(chunks.back(), offset, buf.data(), chunkSize);
+    queuedBytes += chunks.back().size();
+
+    return true;
+}
+
+void PeerLink::writeNext() {
+    if (!connected || writing)
+        return;
+
+    while (chunks.empty()) {
+        if (!current) {
+            if (!startCatchUp())
+                return;
+            continue;
+        }
+
+        if (currentLive) {
+            // Waiting for the receiving connection to tee more data
+            if (!current->complete)
+                return;
+        } else if (readDiskChunk()) {
+            continue;
+        } else if (diskPacked) {
+            packData.clear();
+        } else {
+            diskFile.close();
+        }
+
+        std::cout << __FUNCTION__ << " replicated " << current->userName << "/"
+            << current->fileName << " to " << host << ":" << port << std::endl;
+        current.reset();
+    }
+
+    writing = true;
+    async_write(socket, boost::asio::buffer(chunks.front()),
+            boost::bind(&PeerLink::handleWrite, this,
+                boost::asio::placeholders::error));
+}
+
+void PeerLink::beginFile(const ptrReplicaFile& file) {
+    if (connected && !current && pending.empty()) {
+        current = file;
+        currentLive = true;
+        encoder.reset();
+        queueHeader(file);
+        writeNext();
+    } else {
+        pending.push_back(file);
+    }
+}
+
+void PeerLink::appendData(const ptrReplicaFile& file, std::size_t offset,
+        const char* data, std::size_t size) {
+    if (file != current || !currentLive)
+        return;
+
+    std::string records;
+    encoder.data(records, offset, data, size);
+    if (records.empty())
+        return;
+
+    chunks.push_back(records);
+    queuedBytes += records.size();
+    writeNext();
+}
+
+void PeerLink::endFile(const ptrReplicaFile& file) {
+    if (file == current && currentLive) {
+        // Trailing hole up to the file size
+        std::string records;
+        encoder.finish(records, file->fileSize);
+        if (!records.empty()) {
+            chunks.push_back(records);
+            queuedBytes += records.size();
+        }
+    }
+
+    writeNext();
+}
+
+void PeerLink::abortFile(const ptrReplicaFile& file) {
+    pending.erase(std::remove(pending.begin(), pending.end(), file), pending.end());
+
+    if (file == current) {
+        // The peer is in the middle of the upload, drop the link to abort it
+        std::cerr << "Aborting replication of " << file->userName << "/"
+            << file->fileName << " to " << host << ":" << port << std::endl;
+        current.reset();
+        reset();
+        connect();
+    }
+}
+
+void PeerLink::queueFile(const ptrReplicaFile& file) {
+    pending.push_back(file);
+    writeNext();
+}
+
+bool PeerLink::writable(const ptrReplicaFile& file) const {
+    return file != current || !currentLive
+        || queuedBytes < replicator.queueLimit();
+}
+
+
+Replicator::Replicator(boost::asio::io_service& _ioService, PackStore& _packStore,
+        const SocketOptions& _options, std::size_t _queueSize,
+        const std::string& _token)
+    : ioService(_ioService), packStore(_packStore), options(_options),
+    queueSize(_queueSize), token(_token) {}
+
+void Replicator::addPeer(const std::string& peer) {
+    links.push_back(ptrPeerLink(new PeerLink(ioService, *this, packStore, options, peer)));
+}
+
+std::size_t Replicator::queueLimit() const {
+    return queueSize;
+}
+
+const std::string& Replicator::replicaToken() const {
+    return token;
+}
+
+bool Replicator::acceptsToken(const std::string& candidate) const {
+    // Without a configured token no connection is a peer
+    return !token.empty() && candidate == token;
+}
+
+ptrReplicaFile Replicator::beginFile(const std::string& userName,
+        const std::string& fileName, std::size_t fileSize) {
+    if (links.empty())
+        return ptrReplicaFile();
+
+    ptrReplicaFile file(new ReplicaFile);
+    file->userName = userName;
+    file->fileName = fileName;
+    file->fileSize = fileSize;
+    file->complete = false;
+
+    for (std::size_t i = 0; i < links.size(); i++)
+        links[i]->beginFile(file);
+
+    return file;
+}
+
+void Replicator::appendData(const ptrReplicaFile& file, std::size_t offset,
+        const char* data, std::size_t size) {
+    for (std::size_t i = 0; i < links.size(); i++)
+        links[i]->appendData(file, offset, data, size);
+}
+
+void Replicator::endFile(const ptrReplicaFile& file) {
+    file->complete = true;
+
+    for (std::size_t i = 0; i < links.size(); i++)
+        links[i]->endFile(file);
+}
+
+void Replicator::abortFile(const ptrReplicaFile& file) {
+    for (std::size_t i = 0; i < links.size(); i++)
+        links[i]->abortFile(file);
+
+    notify();
+}
+
+void Replicator::queueFile(const std::string& userName,
+        const std::string& fileName) {
+    if (links.empty())
+        return;
+
+    // The size is taken from disk when the peer gets to it
+    ptrReplicaFile file(new ReplicaFile);
+    file->userName = userName;
+    file->fileName = fileName;
+    file->fileSize = 0;
+    file->complete = true;
+
+    for (std::size_t i = 0; i < links.size(); i++)
+        links[i]->queueFile(file);
+}
+
+bool Replicator::writable(const ptrReplicaFile& file) const {
+    for (std::size_t i = 0; i < links.size(); i++) {
+        if (!links[i]->writable(file))
+            return false;
+    }
+
+    return true;
+}
+
+void Replicator::waitWritable(const ptrReplicaFile& file,
+        const boost::function<void()>& callback) {
+    if (writable(file))
+        ioService.post(callback);
+    else
+        waiters.push_back(Waiter(file, callback));
+}
+
+void Replicator::notify() {
+    std::list<Waiter>::iterator it = waiters.begin();
+
+    while (it != waiters.end()) {
+        if (writable(it->first)) {
+            ioService.post(it->second);
+            it = waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
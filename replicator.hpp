@@ -0,0 +1,160 @@
+#ifndef FILESERVER_REPLICATOR
+#define FILESERVER_REPLICATOR
+
+#include <string>
+#include <deque>
+#include <list>
+#include <vector>
+#include <fstream>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include "sparse.hpp"
+#include "sockopt.hpp"
+#include "packstore.hpp"
+
+
+// User name peer servers log in with, followed by the replica token
+extern const char* const replicaUserName;
+
+// Upload being replicated, shared by the receiving connection and the peers
+struct ReplicaFile {
+    std::string userName;
+    std::string fileName;
+    std::size_t fileSize;
+    bool complete;
+};
+
+typedef boost::shared_ptr<ReplicaFile> ptrReplicaFile;
+
+class Replicator;
+
+// Connection to one peer server. The upload in progress when the link is
+// idle is streamed live from the chunks teed by the receiving connection,
+// every other upload is queued and sent from disk once it is complete.
+class PeerLink : private boost::noncopyable {
+    private:
+        Replicator& replicator;
+        PackStore& packStore;
+        const SocketOptions& options;
+        const std::string host;
+        const std::string port;
+
+        boost::asio::ip::tcp::resolver resolver;
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer reconnectTimer;
+        bool connected;
+        bool writing;
+
+        std::deque<std::string> chunks;
+        std::size_t queuedBytes;
+
+        ptrReplicaFile current;
+        bool currentLive;
+        std::deque<ptrReplicaFile> pending;
+
+        std::ifstream diskFile;
+        std::string packData;
+        bool diskPacked;
+        ExtentCursor diskCursor;
+        RecordEncoder encoder;
+        std::vector<char> buf;
+        char probe;
+
+        void connect();
+
+        void handleResolve(const boost::system::error_code& error,
+                boost::asio::ip::tcp::resolver::iterator myIterator);
+
+        void handleConnect(const boost::system::error_code& error);
+
+        void handleProbe(const boost::system::error_code& error);
+
+        void handleWrite(const boost::system::error_code& error);
+
+        void handleError(const std::string& functionName,
+                const boost::system::error_code& error);
+
+        void handleReconnect(const boost::system::error_code& error);
+
+        void reset();
+
+        void queueHeader(const ptrReplicaFile& file);
+
+        bool startCatchUp();
+
+        bool readDiskChunk();
+
+        void writeNext();
+
+    public:
+        PeerLink(boost::asio::io_service& ioService, Replicator& _replicator,
+                PackStore& _packStore, const SocketOptions& _options,
+                const std::string& peer);
+
+        void beginFile(const ptrReplicaFile& file);
+
+        void appendData(const ptrReplicaFile& file, std::size_t offset,
+                const char* data, std::size_t size);
+
+        void endFile(const ptrReplicaFile& file);
+
+        void abortFile(const ptrReplicaFile& file);
+
+        void queueFile(const ptrReplicaFile& file);
+
+        bool writable(const ptrReplicaFile& file) const;
+};
+
+class Replicator : private boost::noncopyable {
+    typedef boost::shared_ptr<PeerLink> ptrPeerLink;
+    typedef std::pair<ptrReplicaFile, boost::function<void()> > Waiter;
+
+    private:
+        boost::asio::io_service& ioService;
+        PackStore& packStore;
+        const SocketOptions& options;
+        const std::size_t queueSize;
+        const std::string token;
+
+        std::vector<ptrPeerLink> links;
+        std::list<Waiter> waiters;
+
+    public:
+        Replicator(boost::asio::io_service& _ioService, PackStore& _packStore,
+                const SocketOptions& _options, std::size_t _queueSize,
+                const std::string& _token);
+
+        void addPeer(const std::string& peer);
+
+        std::size_t queueLimit() const;
+
+        const std::string& replicaToken() const;
+
+        // True if a peer presenting this token may send replica uploads
+        bool acceptsToken(const std::string& candidate) const;
+
+        ptrReplicaFile beginFile(const std::string& userName,
+                const std::string& fileName, std::size_t fileSize);
+
+        void appendData(const ptrReplicaFile& file, std::size_t offset,
+                const char* data, std::size_t size);
+
+        void endFile(const ptrReplicaFile& file);
+
+        void abortFile(const ptrReplicaFile& file);
+
+        // Sends a file that is already complete on disk, e.g. a server-side copy
+        void queueFile(const std::string& userName, const std::string& fileName);
+
+        bool writable(const ptrReplicaFile& file) const;
+
+        // Runs the callback once every peer has room for more of the file
+        void waitWritable(const ptrReplicaFile& file,
+                const boost::function<void()>& callback);
+
+        void notify();
+};
+
+#endif
@@ -1,13 +1,53 @@
 #include "server.hpp"
 #include <vector>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 
 
-TcpServer::TcpServer(const unsigned short port) :
+ServerConfig::ServerConfig()
+    : port(0), replicaQueueSize(8 * 1024 * 1024), packThreshold(0) {}
+
+TcpServer::TcpServer(const ServerConfig& _config) :
+    config(_config),
+    packStore(ioService, config.packThreshold),
+    replicator(ioService, packStore, config.socketOptions, config.replicaQueueSize,
+            config.replicaToken),
     acceptor(ioService, boost::asio::ip::tcp::endpoint(
-                boost::asio::ip::tcp::v4(), port), true),
-    newConnection(new TcpConnection(ioService)) {
+                boost::asio::ip::tcp::v4(), config.port), true),
+    newConnection(new TcpConnection(ioService, config.socketOptions, replicator,
+                packStore)),
+    localAcceptor(ioService) {
+        // Accepted sockets inherit the buffer sizes of the listening socket
+        applySocketBuffers(acceptor.native_handle(), config.socketOptions);
+
+        for (std::size_t i = 0; i < config.replicas.size(); i++)
+            replicator.addPeer(config.replicas[i]);
+
+        if (!config.unixPath.empty()) {
+            boost::asio::local::stream_protocol::endpoint endpoint(config.unixPath);
+
+            // Remove the socket file left by a previous run, never anything else
+            struct stat pathStat;
+            if (lstat(config.unixPath.c_str(), &pathStat) == 0) {
+                if (!S_ISSOCK(pathStat.st_mode))
+                    throw std::runtime_error(config.unixPath + " exists and is not a socket");
+                unlink(config.unixPath.c_str());
+            }
+            localAcceptor.open(endpoint.protocol());
+            applySocketBuffers(localAcceptor.native_handle(), config.socketOptions);
+            localAcceptor.bind(endpoint);
+            localAcceptor.listen();
+
+            newLocalConnection.reset(new TcpConnection(ioService,
+                        config.socketOptions, replicator, packStore));
+            localAcceptor.async_accept(newLocalConnection->socket(),
+                    boost::bind(&TcpServer::handleLocalAccept, this,
+                        boost::asio::placeholders::error));
+        }
+
         acceptor.async_accept(newConnection->socket(),
                 boost::bind(&TcpServer::handleAccept, this,
                     boost::asio::placeholders::error));
@@ -16,14 +56,31 @@ TcpServer::TcpServer(const unsigned short port) :
 void TcpServer::handleAccept(const boost::system::error_code& error) {
     std::cout << __FUNCTION__ << " " << error << ", " << error.message() << std::endl;
     if (!error) {
+        applySocketOptions(newConnection->socket().native_handle(),
+                config.socketOptions);
         newConnection->start();
-        newConnection.reset(new TcpConnection(ioService));
+        newConnection.reset(new TcpConnection(ioService, config.socketOptions,
+                    replicator, packStore));
         acceptor.async_accept(newConnection->socket(),
                 boost::bind(&TcpServer::handleAccept, this,
                     boost::asio::placeholders::error));
     }
 }
 
+void TcpServer::handleLocalAccept(const boost::system::error_code& error) {
+    std::cout << __FUNCTION__ << " " << error << ", " << error.message() << std::endl;
+    if (!error) {
+        applySocketOptions(newLocalConnection->socket().native_handle(),
+                config.socketOptions);
+        newLocalConnection->start();
+        newLocalConnection.reset(new TcpConnection(ioService, config.socketOptions,
+                    replicator, packStore));
+        localAcceptor.async_accept(newLocalConnection->socket(),
+                boost::bind(&TcpServer::handleLocalAccept, this,
+                    boost::asio::placeholders::error));
+    }
+}
+
 void TcpServer::run() {
     ioService.run();
 }
@@ -33,17 +90,70 @@ void TcpServer::stop() {
 }
 
 
+static void usage() {
+    std::cout << "Usage: port# [options]\n"
+        << "  --replica host:port  replicate uploads to a peer server, repeatable\n"
+        << "  --replica-queue bytes  data buffered per peer before uploads stall\n"
+        << "  --replica-token secret  shared by peer servers, needed to send or\n"
+        << "                       accept replicated uploads\n"
+        << "  --unix path          also listen on a Unix domain socket\n"
+        << "  --pack-threshold bytes  pack files smaller than this, up to 16MB\n"
+        << socketOptionsUsage();
+}
+
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 2) {
-            std::cout << "Usage: port#" << std::endl;
+        if (argc < 2) {
+            usage();
             return 0;
         }
 
-        const unsigned short port = atoi(argv[1]);
+        ServerConfig config;
+        config.port = atoi(argv[1]);
+
+        for (int i = 2; i < argc; ) {
+            std::string option = argv[i];
+            int consumed = parseSocketOption(argc, argv, i, config.socketOptions);
+
+            if (consumed == 0 && i + 1 < argc) {
+                if (option == "--replica") {
+                    config.replicas.push_back(argv[i + 1]);
+                    consumed = 2;
+                } else if (option == "--replica-queue" && atol(argv[i + 1]) > 0) {
+                    config.replicaQueueSize = atol(argv[i + 1]);
+                    consumed = 2;
+                } else if (option == "--replica-token") {
+                    config.replicaToken = argv[i + 1];
+                    consumed = 2;
+                } else if (option == "--unix") {
+                    config.unixPath = argv[i + 1];
+                    consumed = 2;
+                } else if (option == "--pack-threshold" && atol(argv[i + 1]) > 0
+                        && (std::size_t)atol(argv[i + 1]) <= packThresholdLimit) {
+                    config.packThreshold = atol(argv[i + 1]);
+                    consumed = 2;
+                }
+            }
+
+            if (consumed == 0) {
+                std::cout << "Unknown option " << argv[i] << std::endl;
+                usage();
+                return 0;
+            }
+            i += consumed;
+        }
+
+        if (!config.replicas.empty() && config.replicaToken.empty()) {
+            std::cout << "--replica needs --replica-token" << std::endl;
+            usage();
+            return 0;
+        }
 
-        std::cout << argv[0] << " listen on port " << port << std::endl;
-        TcpServer myTcpServer(port);
+        std::cout << argv[0] << " listen on port " << config.port;
+        if (!config.unixPath.empty())
+            std::cout << " and " << config.unixPath;
+        std::cout << std::endl;
+        TcpServer myTcpServer(config);
 
         myTcpServer.run();
         myTcpServer.stop();
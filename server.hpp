@@ -2,22 +2,48 @@
 #define FILESERVER_SERVER
 
 #include "connection.hpp"
+#include "sockopt.hpp"
+#include "replicator.hpp"
+#include "packstore.hpp"
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
 
 
+struct ServerConfig {
+    unsigned short port;
+    SocketOptions socketOptions;
+    std::vector<std::string> replicas;      // host:port of peer servers
+    std::size_t replicaQueueSize;
+    std::string replicaToken;               // shared by the peer servers
+    std::string unixPath;                   // also listen here if not empty
+    std::size_t packThreshold;              // smaller files are packed, 0 = off
+
+    ServerConfig();
+};
+
 class TcpServer : private boost::noncopyable {
     typedef boost::shared_ptr<TcpConnection> ptrTcpConnection;
 
     private:
+        const ServerConfig config;
+
         boost::asio::io_service ioService;
+        PackStore packStore;
+        Replicator replicator;
         boost::asio::ip::tcp::acceptor acceptor;
         ptrTcpConnection newConnection;
 
+        boost::asio::local::stream_protocol::acceptor localAcceptor;
+        ptrTcpConnection newLocalConnection;
+
         void handleAccept(const boost::system::error_code& error);
 
+        void handleLocalAccept(const boost::system::error_code& error);
+
     public:
-        TcpServer(const unsigned short port);
+        TcpServer(const ServerConfig& _config);
 
         void run();
 
@@ -0,0 +1,173 @@
+#include "sockopt.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+
+SocketOptions::SocketOptions()
+    : sendBufferSize(0), recvBufferSize(0), noDelay(true), cork(true),
+    busyPoll(0), minChunkSize(4096), maxChunkSize(1024 * 1024) {}
+
+int parseSocketOption(int argc, char* argv[], int i, SocketOptions& options) {
+    std::string option = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if (option == "--nodelay") {
+        options.noDelay = true;
+        return 1;
+    } else if (option == "--no-nodelay") {
+        options.noDelay = false;
+        return 1;
+    } else if (option == "--cork") {
+        options.cork = true;
+        return 1;
+    } else if (option == "--no-cork") {
+        options.cork = false;
+        return 1;
+    }
+
+    if (!hasValue)
+        return 0;
+
+    // Trailing garbage, negative and out of range values are all refused
+    char* end = NULL;
+    errno = 0;
+    long value = strtol(argv[i + 1], &end, 10);
+    if (end == argv[i + 1] || *end != '\0' || errno == ERANGE
+            || value < 0 || value > INT_MAX)
+        return 0;
+
+    if (option == "--sndbuf") {
+        options.sendBufferSize = value;
+    } else if (option == "--rcvbuf") {
+        options.recvBufferSize = value;
+    } else if (option == "--busy-poll") {
+        options.busyPoll = value;
+    } else if (option == "--chunk-min" && value > 0) {
+        options.minChunkSize = value;
+    } else if (option == "--chunk-max" && value > 0) {
+        options.maxChunkSize = value;
+    } else {
+        return 0;
+    }
+
+    if (options.maxChunkSize < options.minChunkSize)
+        options.maxChunkSize = options.minChunkSize;
+
+    return 2;
+}
+
+std::string socketOptionsUsage() {
+    return "  --sndbuf bytes      SO_SNDBUF, kernel default if 0\n"
+        "  --rcvbuf bytes      SO_RCVBUF, kernel default if 0\n"
+        "  --no-nodelay        keep Nagle's algorithm enabled\n"
+        "  --no-cork           do not cork header and file data together\n"
+        "  --busy-poll usec    SO_BUSY_POLL, disabled if 0\n"
+        "  --chunk-min bytes   smallest file chunk (4096)\n"
+        "  --chunk-max bytes   largest file chunk (1048576)\n";
+}
+
+static void setOption(int fd, int level, int name, int value, const char* optionName) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        std::cerr << "Failed to set " << optionName << ": "
+            << strerror(errno) << std::endl;
+    }
+}
+
+static bool isTcpSocket(int fd) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+
+    if (getsockname(fd, (struct sockaddr*)&address, &length) < 0)
+        return false;
+
+    return address.ss_family == AF_INET || address.ss_family == AF_INET6;
+}
+
+void applySocketBuffers(int fd, const SocketOptions& options) {
+    if (options.sendBufferSize > 0)
+        setOption(fd, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize, "SO_SNDBUF");
+    if (options.recvBufferSize > 0)
+        setOption(fd, SOL_SOCKET, SO_RCVBUF, options.recvBufferSize, "SO_RCVBUF");
+}
+
+void applySocketOptions(int fd, const SocketOptions& options) {
+    applySocketBuffers(fd, options);
+
+    if (options.busyPoll > 0)
+        setOption(fd, SOL_SOCKET, SO_BUSY_POLL, options.busyPoll, "SO_BUSY_POLL");
+
+    if (isTcpSocket(fd))
+        setOption(fd, IPPROTO_TCP, TCP_NODELAY, options.noDelay, "TCP_NODELAY");
+}
+
+void setCork(int fd, bool on) {
+    if (isTcpSocket(fd))
+        setOption(fd, IPPROTO_TCP, TCP_CORK, on, "TCP_CORK");
+}
+
+// Smoothed round trip time in seconds, 0 if unknown
+static double roundTripTime(int fd) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+        return 0;
+
+    return info.tcpi_rtt / 1000000.0;
+}
+
+
+ChunkSizer::ChunkSizer(const SocketOptions& options)
+    : minSize(options.minChunkSize),
+    maxSize(std::max(options.minChunkSize, options.maxChunkSize)),
+    chunkSize(options.minChunkSize), pendingBytes(0), lastThroughput(0) {}
+
+std::size_t ChunkSizer::size() const {
+    return chunkSize;
+}
+
+void ChunkSizer::begin(std::size_t bytes) {
+    pendingBytes = bytes;
+    startTime = boost::posix_time::microsec_clock::universal_time();
+}
+
+void ChunkSizer::complete(int fd) {
+    if (pendingBytes == 0)
+        return;
+
+    boost::posix_time::time_duration elapsed =
+        boost::posix_time::microsec_clock::universal_time() - startTime;
+    double seconds = std::max((long)elapsed.total_microseconds(), 1L) / 1000000.0;
+    double throughput = pendingBytes / seconds;
+    double rtt = roundTripTime(fd);
+
+    pendingBytes = 0;
+
+    if (rtt > 0) {
+        // bandwidth-delay product
+        double target = throughput * rtt;
+
+        if (chunkSize < target)
+            chunkSize *= 2;
+        else if (chunkSize > 2 * target)
+            chunkSize /= 2;
+    } else if (throughput >= lastThroughput) {
+        chunkSize *= 2;
+    } else {
+        chunkSize /= 2;
+    }
+
+    chunkSize = std::min(std::max(chunkSize, minSize), maxSize);
+    lastThroughput = throughput;
+}
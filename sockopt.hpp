@@ -0,0 +1,56 @@
+#ifndef FILESERVER_SOCKOPT
+#define FILESERVER_SOCKOPT
+
+#include <string>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+
+struct SocketOptions {
+    int sendBufferSize;         // SO_SNDBUF, 0 keeps the kernel default
+    int recvBufferSize;         // SO_RCVBUF, 0 keeps the kernel default
+    bool noDelay;               // TCP_NODELAY
+    bool cork;                  // TCP_CORK around header + file data
+    int busyPoll;               // SO_BUSY_POLL in usec, 0 disables it
+    std::size_t minChunkSize;
+    std::size_t maxChunkSize;
+
+    SocketOptions();
+};
+
+// Returns the number of arguments consumed at argv[i], 0 if not a socket option
+int parseSocketOption(int argc, char* argv[], int i, SocketOptions& options);
+
+std::string socketOptionsUsage();
+
+// Buffer sizes only, these have to be set before connect/listen to affect
+// the TCP window scale
+void applySocketBuffers(int fd, const SocketOptions& options);
+
+void applySocketOptions(int fd, const SocketOptions& options);
+
+void setCork(int fd, bool on);
+
+// Picks the size of the next file chunk written to the socket. The chunk
+// grows while it is smaller than the bandwidth-delay product measured from
+// write completions and the TCP_INFO round trip time, and shrinks when it
+// is well above it.
+class ChunkSizer {
+    private:
+        std::size_t minSize;
+        std::size_t maxSize;
+        std::size_t chunkSize;
+        std::size_t pendingBytes;
+        double lastThroughput;
+        boost::posix_time::ptime startTime;
+
+    public:
+        ChunkSizer(const SocketOptions& options);
+
+        std::size_t size() const;
+
+        void begin(std::size_t bytes);
+
+        void complete(int fd);
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include "sparse.hpp"
+#include <cerrno>
+#include <algorithm>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Holes smaller than a file system block cannot be stored anyway
+static const std::size_t zeroBlockSize = 4096;
+static const std::size_t copyBufferSize = 64 * zeroBlockSize;
+
+
+ExtentCursor::ExtentCursor()
+    : index(0), extentRemain(0), dataRemain(0) {}
+
+void ExtentCursor::reset(const ExtentList& _extents) {
+    extents = _extents;
+    index = 0;
+    extentRemain = 0;
+    dataRemain = 0;
+
+    for (std::size_t i = 0; i < extents.size(); i++)
+        dataRemain += extents[i].length;
+
+    if (!extents.empty())
+        extentRemain = extents[0].length;
+
+    // Skip empty extents
+    while (extentRemain == 0 && index + 1 < extents.size())
+        extentRemain = extents[++index].length;
+}
+
+const ExtentList& ExtentCursor::list() const {
+    return extents;
+}
+
+bool ExtentCursor::done() const {
+    return dataRemain == 0;
+}
+
+std::size_t ExtentCursor::offset() const {
+    if (extents.empty())
+        return 0;
+    return extents[index].offset + extents[index].length - extentRemain;
+}
+
+std::size_t ExtentCursor::chunk(std::size_t maxBytes) const {
+    return std::min(maxBytes, extentRemain);
+}
+
+std::size_t ExtentCursor::remain() const {
+    return dataRemain;
+}
+
+void ExtentCursor::advance(std::size_t bytes) {
+    while (bytes > 0 && dataRemain > 0) {
+        std::size_t n = std::min(bytes, extentRemain);
+        extentRemain -= n;
+        dataRemain -= n;
+        bytes -= n;
+
+        while (extentRemain == 0 && index + 1 < extents.size())
+            extentRemain = extents[++index].length;
+    }
+}
+
+
+bool isZeroBlock(const char* data, std::size_t size) {
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 64 <= size; i += 64) {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)),
+                    _mm_loadu_si128((const __m128i*)(data + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)),
+                    _mm_loadu_si128((const __m128i*)(data + i + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return false;
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (data[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void addExtent(ExtentList& extents, std::size_t offset, std::size_t length) {
+    if (!extents.empty() &&
+            extents.back().offset + extents.back().length == offset) {
+        extents.back().length += length;
+    } else {
+        extents.push_back(Extent(offset, length));
+    }
+}
+
+ExtentList mapHoleExtents(int fd, std::size_t fileSize) {
+    ExtentList extents;
+    std::size_t offset = 0;
+
+    while (offset < fileSize) {
+        off_t dataBegin = lseek(fd, (off_t)offset, SEEK_DATA);
+        off_t dataEnd;
+
+        if (dataBegin < 0) {
+            if (errno == ENXIO)
+                break;
+            // File system without SEEK_DATA support
+            dataBegin = offset;
+            dataEnd = fileSize;
+        } else {
+            dataEnd = lseek(fd, dataBegin, SEEK_HOLE);
+            if (dataEnd < 0 || (std::size_t)dataEnd > fileSize)
+                dataEnd = fileSize;
+        }
+
+        if (dataEnd > dataBegin)
+            addExtent(extents, dataBegin, dataEnd - dataBegin);
+        offset = dataEnd;
+    }
+
+    return extents;
+}
+
+ExtentList mapHoleExtents(const std::string& filePath, std::size_t fileSize) {
+    int fd = open(filePath.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        // Fall back to sending every byte
+        ExtentList extents;
+        if (fileSize > 0)
+            extents.push_back(Extent(0, fileSize));
+        return extents;
+    }
+
+    ExtentList extents = mapHoleExtents(fd, fileSize);
+    close(fd);
+
+    return extents;
+}
+
+static bool copyRangeUser(int inFd, std::size_t inOffset, int outFd,
+        std::size_t outOffset, std::size_t length) {
+    std::vector<char> copyBuffer(copyBufferSize);
+
+    while (length > 0) {
+        ssize_t bytesRead = pread(inFd, &copyBuffer[0],
+                std::min(length, copyBuffer.size()), (off_t)inOffset);
+        if (bytesRead <= 0)
+            return false;
+
+        if (pwrite(outFd, &copyBuffer[0], bytesRead, (off_t)outOffset) != bytesRead)
+            return false;
+
+        inOffset += bytesRead;
+        outOffset += bytesRead;
+        length -= bytesRead;
+    }
+
+    return true;
+}
+
+bool copyFileRange(int inFd, std::size_t inOffset, int outFd,
+        std::size_t outOffset, std::size_t length) {
+    loff_t inPos = inOffset;
+    loff_t outPos = outOffset;
+
+    while (length > 0) {
+        ssize_t copied = copy_file_range(inFd, &inPos, outFd, &outPos, length, 0);
+
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS
+                    || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // No in-kernel copy between these files
+            return copyRangeUser(inFd, inPos, outFd, outPos, length);
+        } else if (copied <= 0) {
+            return false;
+        }
+
+        length -= copied;
+    }
+
+    return true;
+}
+
+bool copyFileData(int inFd, std::size_t inOffset, int outFd, std::size_t fileSize) {
+    ExtentList extents;
+
+    // Entries inside a pack file are small, copy them in one piece
+    if (inOffset == 0)
+        extents = mapHoleExtents(inFd, fileSize);
+    else if (fileSize > 0)
+        extents.push_back(Extent(0, fileSize));
+
+    for (std::size_t i = 0; i < extents.size(); i++) {
+        if (!copyFileRange(inFd, inOffset + extents[i].offset, outFd,
+                    extents[i].offset, extents[i].length))
+            return false;
+    }
+
+    return ftruncate(outFd, (off_t)fileSize) == 0;
+}
+
+bool cloneFile(int inFd, int outFd) {
+    return ioctl(outFd, FICLONE, inFd) == 0;
+}
+
+
+RecordEncoder::RecordEncoder()
+    : position(0), holeLength(0), finished(false) {}
+
+void RecordEncoder::reset() {
+    position = 0;
+    holeLength = 0;
+    finished = false;
+}
+
+bool RecordEncoder::done() const {
+    return finished;
+}
+
+void RecordEncoder::appendHeader(std::string& out, char type, std::size_t length) {
+    std::ostringstream header;
+    header << type << " " << length << "\n";
+    out += header.str();
+}
+
+void RecordEncoder::flushHole(std::string& out) {
+    if (holeLength > 0)
+        appendHeader(out, 'H', holeLength);
+    holeLength = 0;
+}
+
+void RecordEncoder::data(std::string& out, std::size_t offset,
+        const char* data, std::size_t size) {
+    // Everything skipped since the last call is a hole
+    holeLength += offset - position;
+    position = offset + size;
+
+    std::size_t i = 0;
+    while (i < size) {
+        std::size_t blockSize = std::min(zeroBlockSize, size - i);
+        if (isZeroBlock(data + i, blockSize)) {
+            holeLength += blockSize;
+            i += blockSize;
+            continue;
+        }
+
+        std::size_t begin = i;
+        do {
+            i += blockSize;
+            blockSize = std::min(zeroBlockSize, size - i);
+        } while (i < size && !isZeroBlock(data + i, blockSize));
+
+        flushHole(out);
+        appendHeader(out, 'D', i - begin);
+        out.append(data + begin, i - begin);
+    }
+}
+
+void RecordEncoder::finish(std::string& out, std::size_t fileSize) {
+    if (fileSize > position)
+        holeLength += fileSize - position;
+    position = fileSize;
+    flushHole(out);
+    finished = true;
+}
+
+bool readRecord(std::istream& stream, bool& hole, std::size_t& length) {
+    char type = 0;
+    stream >> type >> length;
+    stream.get();
+
+    hole = type == 'H';
+    return stream && (type == 'D' || type == 'H') && length > 0;
+}
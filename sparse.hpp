@@ -0,0 +1,99 @@
+#ifndef FILESERVER_SPARSE
+#define FILESERVER_SPARSE
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+
+// Data region of a file, everything outside of the extents reads as zero
+struct Extent {
+    std::size_t offset;
+    std::size_t length;
+
+    Extent(std::size_t _offset, std::size_t _length)
+        : offset(_offset), length(_length) {}
+};
+
+typedef std::vector<Extent> ExtentList;
+
+// Walks an extent list in chunks, e.g. the data regions of a file that
+// is being sent or copied
+class ExtentCursor {
+    private:
+        ExtentList extents;
+        std::size_t index;
+        std::size_t extentRemain;
+        std::size_t dataRemain;
+
+    public:
+        ExtentCursor();
+
+        void reset(const ExtentList& _extents);
+
+        const ExtentList& list() const;
+
+        bool done() const;
+
+        std::size_t offset() const;
+
+        std::size_t chunk(std::size_t maxBytes) const;
+
+        std::size_t remain() const;
+
+        void advance(std::size_t bytes);
+};
+
+bool isZeroBlock(const char* data, std::size_t size);
+
+// Data regions from SEEK_DATA/SEEK_HOLE, nothing is read. All-zero blocks
+// inside them are found by RecordEncoder while the data is sent
+ExtentList mapHoleExtents(int fd, std::size_t fileSize);
+
+ExtentList mapHoleExtents(const std::string& filePath, std::size_t fileSize);
+
+// Copies fileSize bytes at inOffset to the start of outFd in the kernel
+// with copy_file_range, holes are skipped and outFd is sized to fileSize
+bool copyFileData(int inFd, std::size_t inOffset, int outFd, std::size_t fileSize);
+
+// One range of copyFileData, falls back to pread/pwrite across filesystems
+bool copyFileRange(int inFd, std::size_t inOffset, int outFd,
+        std::size_t outOffset, std::size_t length);
+
+// Shares the blocks of inFd with outFd (reflink), false if the filesystem
+// or the pair of files does not support it
+bool cloneFile(int inFd, int outFd);
+
+// A file goes on the wire as records that add up to its size: "D len\n"
+// followed by len bytes of data, or "H len\n" for len zero bytes that the
+// receiver seeks over. Zero blocks are found as the data is read, so a
+// file is scanned and sent in the same pass.
+class RecordEncoder {
+    private:
+        std::size_t position;
+        std::size_t holeLength;
+        bool finished;
+
+        void appendHeader(std::string& out, char type, std::size_t length);
+
+        void flushHole(std::string& out);
+
+    public:
+        RecordEncoder();
+
+        void reset();
+
+        bool done() const;
+
+        // Appends the records for file data read at offset, offsets only grow
+        void data(std::string& out, std::size_t offset,
+                const char* data, std::size_t size);
+
+        // Appends the trailing hole up to fileSize
+        void finish(std::string& out, std::size_t fileSize);
+};
+
+// Parses one record header, the caller checks the length against the file
+bool readRecord(std::istream& stream, bool& hole, std::size_t& length);
+
+#endif